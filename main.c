@@ -5,177 +5,307 @@
 #define THEME tim
 // #define MAX_PINS 22
 // #define TRACE
+// #define JIT
+// #define THREADS
+// #define PRINT_ASYNC
 #define API static
 
+// for lstat, MAP_ANONYMOUS, clock_gettime and nanosleep
+#define _DEFAULT_SOURCE
+
 #include "src/data.c"
 #include "src/lists.c"
 #include "src/tables.c"
 #include "src/iter.c"
 #include "src/dump.c"
+#include "src/encode.c"
+#include "src/reader.c"
 #include "src/editor.c"
 #include "src/print.c"
 #include "src/runtime.c"
+#include "src/optimize.c"
+#include "src/compiler.c"
+#include "src/vm.c"
+#include "src/jit.c"
+#include "src/parallel.c"
 #include "src/symbols.c"
 
 static value_t repl;
 
 
-// Look for dots and parse into list of symbols if found.
-static value_t getSymbols(const char* start, const char* end) {
-  value_t parts = Nil;
-  const char* s = start;
-  const char* i = s;
-  while (i < end) {
-    if (*i == '.' && i > s) {
-      value_t sym = SymbolRange(s, i);
-      parts = cons(sym, parts);
-      s = i + 1;
-    }
-    i++;
-  }
-  if (isNil(parts)) return SymbolRange(start, end);
-  return list_ireverse(cons(SymbolRange(s,end), parts));
-}
+// Each line is read and run in a region of its own, what doesn't end up in
+// repl is freed with it.  A form can go on over several lines, the parser
+// keeps what it has of it meanwhile.
+static parser_t reader;
 
 static void parse(const char *data) {
-  value_t stack = Nil;
-  value_t value = Nil;
-  bool quote = false;
-  bool neg = false;
-  while (*data) {
-    // Skip whitespace
-    if (*data == ' ') {
-      data++;
-    }
-    // Push stack when on open paren
-    else if (*data == '(' || *data == '[') {
-      stack = cons(value, stack);
-      value = Nil;
-      if (quote) {
-        quote = false;
-        value = cons(quoteSym, value);
-      }
-      if (*data == '[') {
-        value = cons(listSym, value);
-      }
-      data++;
-    }
-    // pop stack on close paren
-    else if (*data == ')' || *data == ']') {
-      value_t fixed = Nil;
-      bool dot = false;
-      while (value.type == PairType) {
-        pair_t pair = get_pair(value);
-        if (eq(pair.left, Dot)) {
-          dot = true;
-        }
-        else {
-          if (dot) {
-            dot = false;
-            fixed = free_cell(fixed).left;
-          }
-          set_cdr(value, fixed);
-          fixed = value;
-        }
-        value = pair.right;
-      }
-      value = cons(fixed, car(stack));
-      stack = free_cell(stack).right;
-      data++;
-    }
-    else if (*data == '\'') {
-      quote = true;
-      data++;
-    }
-    else if (*data == '-' && *(data + 1) &&
-             *(data + 1) >= '0' && *(data + 1) <= '9') {
-      neg = true;
-      data++;
-    }
-    else if (*data >= '0' && *data <= '9') {
-      int num = 0;
-      while (*data >= '0' && *data <= '9') {
-        num = num * 10 + *data - '0';
-        data++;
-      }
-      if (neg) {
-        neg = false;
-        num = -num;
-      }
-      value_t atom = Integer(num);
-      if (quote) {
-        quote = false;
-        atom = cons(quoteSym, atom);
-      }
-      value = cons(atom, value);
-    }
-    else if (*data == '"') {
-      const char* start = ++data;
-      while (*data && *data != '"') data++;
-      value = cons(cons(quoteSym, SymbolRange(start, data++)), value);
-    }
-    else {
-      const char* start = data;
-      while (*data && *data != ' ' &&
-             *data != '(' && *data != ')' &&
-             *data != '[' && *data != ']') {
-        data++;
-      }
-      value_t atom;
-      int len = data - start;
-      if (len == 1 && start[0] == '.') {
-        atom = Dot;
-      }
-      else if (len == 3 &&
-          start[0] == 'n' &&
-          start[1] == 'i' &&
-          start[2] == 'l') {
-        atom = Nil;
-      }
-      else if (len == 4 &&
-          start[0] == 't' &&
-          start[1] == 'r' &&
-          start[2] == 'u' &&
-          start[3] == 'e') {
-        atom = True;
-      }
-      else if (len == 5 &&
-          start[0] == 'f' &&
-          start[1] == 'a' &&
-          start[2] == 'l' &&
-          start[3] == 's' &&
-          start[4] == 'e') {
-        atom = False;
-      }
-      else {
-        atom = getSymbols(start, data);
-      }
-      if (quote) {
-        quote = false;
-        atom = cons(quoteSym, atom);
-      }
-      value = cons(atom, value);
-    }
-  }
-  stack = free_list(stack);
-  value = list_ireverse(value);
+  region_begin();
+  size_t len = 0;
+  while (data[len]) len++;
+  parser_feed(&reader, data, len);
+  parser_feed(&reader, "\n", 1);
+  value_t value = parser_take(&reader);
 
   print("\r\x1b[K");
   print(prompt);
   dump_line(value);
-  value_t parts = value;
   while (value.type == PairType) {
-    value_t expr = next(&value);
+    value_t expr = optimize(next(&value));
     dump(eval(repl, expr));
-    free_list(expr);
   }
-  free_list(parts);
-  int freed = collectgarbage(repl);
+  int freed = region_end(repl);
   print("gc: ");
   print_int(freed);
   print_char('\n');
 }
 
+#include <fcntl.h>    // for open
+#include <unistd.h>   // for read and close
+#include <errno.h>    // for EINTR
+#include <sys/mman.h> // for mmap
+#include <sys/stat.h> // for fstat, lstat and fchmod
+#include <stdio.h>    // for rename
+#include <string.h>   // for strlen, memcpy and memcmp
+
+static bool is_error(value_t val) {
+  return eq(val, TypeError) || eq(val, RangeError);
+}
+
+// Tell on stderr what went wrong where, with the form that failed if any.
+static void report(const char *path, const char *problem, value_t form) {
+  print_to(2);
+  print(path);
+  print(": ");
+  print(problem);
+  if (!isNil(form)) {
+    print_char(' ');
+    dump_limited(cons(form, Nil), (dump_limits_t){ .depth = 3, .length = 8 });
+  }
+  else {
+    print_char('\n');
+  }
+  print_to(1);
+}
+
+// Run forms until one gives an error, reporting it on stderr.
+static bool run_forms(const char *path, value_t forms) {
+  while (forms.type == PairType) {
+    value_t form = next(&forms);
+    value_t result = eval(repl, optimize(form));
+    if (is_error(result)) {
+      report(path, eq(result, TypeError) ? "type-error in" : "range-error in",
+        form);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Run the forms that close in the next len bytes of a script, or with no
+// data what's left at its end, in a region of their own.  With a cache
+// they're encoded into it first, before running can change them, forms
+// that can't be encoded drop the cache.  A script that ends inside a list
+// or string fails.
+static bool run_source(const char *path, const char *data, size_t len,
+    bytes_t **cache) {
+  region_begin();
+  value_t forms = Nil;
+  if (!data) {
+    const char *problem;
+    forms = parser_end(&reader, &problem);
+    if (problem) {
+      region_end(repl);
+      report(path, problem, Nil);
+      return false;
+    }
+  }
+  else {
+    parser_feed(&reader, data, len);
+    forms = parser_take(&reader);
+  }
+  if (cache && *cache && !encode(forms, *cache)) {
+    free((*cache)->data);
+    **cache = (bytes_t){0};
+    *cache = 0;
+  }
+  bool ok = run_forms(path, forms);
+  region_end(repl);
+  return ok;
+}
+
+// The whole of a regular file, mapped instead of read, or 0.
+static const char *source_map(int fd, size_t *size) {
+  struct stat info;
+  if (fstat(fd, &info) || !S_ISREG(info.st_mode) || !info.st_size) return 0;
+  void *data = mmap(0, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) return 0;
+  *size = (size_t)info.st_size;
+  return data;
+}
+
+// 64 bit FNV-1a.
+static uint64_t hash_bytes(const void *data, size_t len) {
+  const uint8_t *bytes = data;
+  uint64_t hash = 14695981039346656037u;
+  for (size_t i = 0; i < len; i++) hash = (hash ^ bytes[i]) * 1099511628211u;
+  return hash;
+}
+
+// A mapped script's parsed forms are kept in <script>.cache, one encoded
+// message per slice, so a script that hasn't changed since is run without
+// tokenizing it and each symbol is interned once per slice instead of once
+// per use.  The header ties it to the source, the reader and the vm, the
+// payload hash catches files cut short by a reset.
+typedef struct {
+  char magic[4];
+  uint32_t version;      // encoding version, see src/encode.c
+  uint32_t reader;       // READER_VERSION, see src/reader.c
+  uint32_t unused;
+  uint64_t vm;           // hash of VM_VERSION
+  uint64_t source;       // hash of the script
+  uint64_t source_size;
+  uint64_t payload;      // hash of what follows
+  uint64_t payload_size;
+} cache_header_t;
+
+static cache_header_t cache_header(const char *source, size_t size) {
+  return (cache_header_t){
+    .magic = "UJKL",
+    .version = ENC_VERSION,
+    .reader = READER_VERSION,
+    .vm = hash_bytes(VM_VERSION, sizeof(VM_VERSION) - 1),
+    .source = hash_bytes(source, size),
+    .source_size = size,
+  };
+}
+
+static char *cache_path(const char *path, const char *suffix) {
+  size_t len = strlen(path), extra = strlen(suffix);
+  char *name = malloc(len + extra + 1);
+  memcpy(name, path, len);
+  memcpy(name + len, suffix, extra + 1);
+  return name;
+}
+
+// Run the script from its cache if that's still good for this source.
+// False if there's no such cache and nothing was run, else *ok says how
+// running went.
+static bool cache_run(const char *path, cache_header_t want, bool *ok) {
+  char *name = cache_path(path, ".cache");
+  int fd = open(name, O_RDONLY);
+  free(name);
+  if (fd < 0) return false;
+  size_t size;
+  const char *map = source_map(fd, &size);
+  close(fd);
+  if (!map) return false;
+  cache_header_t have;
+  bool fresh = size >= sizeof(have);
+  if (fresh) memcpy(&have, map, sizeof(have));
+  const uint8_t *payload = (const uint8_t *)map + sizeof(have);
+  fresh = fresh && !memcmp(have.magic, want.magic, sizeof(want.magic)) &&
+    have.version == want.version && have.reader == want.reader &&
+    have.vm == want.vm &&
+    have.source == want.source && have.source_size == want.source_size &&
+    have.payload_size == size - sizeof(have) &&
+    have.payload == hash_bytes(payload, (size_t)have.payload_size);
+  *ok = true;
+  for (size_t at = 0; fresh && *ok && at < have.payload_size;) {
+    region_begin();
+    value_t forms;
+    long used = decode(payload + at, (size_t)have.payload_size - at, &forms);
+    // Can't happen with the payload hash matching, but don't loop on it.
+    if (used <= 0) {
+      region_end(repl);
+      report(path, "bad cache", Nil);
+      *ok = false;
+      break;
+    }
+    at += (size_t)used;
+    *ok = run_forms(path, forms);
+    region_end(repl);
+  }
+  munmap((void *)map, size);
+  return fresh;
+}
+
+// Write the cache next to the script, through a temporary file so a reset
+// halfway leaves either the old one or none.  The temporary gets a name of
+// its own from mkstemp, never a file or link someone put there before.
+static void cache_write(const char *path, cache_header_t header,
+    bytes_t *payload) {
+  header.payload = hash_bytes(payload->data, payload->len);
+  header.payload_size = payload->len;
+  char *name = cache_path(path, ".cache");
+  char *temp = cache_path(name, ".XXXXXX");
+  int fd = mkstemp(temp);
+  if (fd >= 0) {
+    bool ok = !fchmod(fd, 0644) &&
+      write(fd, &header, sizeof(header)) == sizeof(header) &&
+      write(fd, payload->data, payload->len) == (ssize_t)payload->len;
+    close(fd);
+    if (!ok || rename(temp, name)) unlink(temp);
+  }
+  free(temp);
+  free(name);
+}
+
+// Run a script without echoing it or its results, "-" for stdin.  Files
+// are parsed straight out of a mapping MAP_SLICE_LENGTH bytes at a time,
+// or with SCRIPT_CACHE taken from their cache when they haven't changed.
+// Only scripts named by a path that is itself a regular file are cached,
+// not stdin nor links like /dev/stdin that could point anywhere.  Pipes
+// are read READ_BUFFER_LENGTH bytes at a time.
+static bool run_script(const char *path) {
+  bool stdin_path = path[0] == '-' && !path[1];
+  int fd = stdin_path ? 0 : open(path, O_RDONLY);
+  if (fd < 0) {
+    report(path, "can't open", Nil);
+    return false;
+  }
+  bool ok = true;
+  size_t size;
+  const char *map = source_map(fd, &size);
+  if (map) {
+    cache_header_t header = cache_header(map, size);
+    bytes_t cache = {0};
+    struct stat info;
+    bool cached = SCRIPT_CACHE && !stdin_path && !lstat(path, &info) &&
+      S_ISREG(info.st_mode);
+    if (!cached || !cache_run(path, header, &ok)) {
+      bytes_t *into = cached ? &cache : 0;
+      for (size_t at = 0; ok && at < size; at += MAP_SLICE_LENGTH) {
+        size_t len = size - at < MAP_SLICE_LENGTH ? size - at :
+          MAP_SLICE_LENGTH;
+        ok = run_source(path, map + at, len, &into);
+      }
+      if (ok) ok = run_source(path, 0, 0, &into);
+      if (ok && into) cache_write(path, header, into);
+    }
+    free(cache.data);
+    munmap((void *)map, size);
+  }
+  else {
+    char chunk[READ_BUFFER_LENGTH];
+    for (;;) {
+      ssize_t got = read(fd, chunk, sizeof(chunk));
+      if (got < 0 && errno == EINTR) continue;
+      if (got < 0) {
+        report(path, "read failed", Nil);
+        ok = false;
+      }
+      if (got <= 0 || !ok) break;
+      ok = run_source(path, chunk, (size_t)got, 0);
+    }
+    if (ok) ok = run_source(path, 0, 0, 0);
+  }
+  if (!stdin_path) close(fd);
+  return ok;
+}
+
+// Argument i of an array native, undefined when missing like next().
+#define Arg(i) ((i) < argc ? argv[i] : Undefined)
+
 // Passes values through unaffected
 static value_t _quote(value_t args) {
   return cdr(args);
@@ -186,151 +316,135 @@ static value_t _list(value_t args) {
   return args;
 }
 
-static value_t _cons(value_t args) {
-  value_t a = next(&args);
-  value_t b = next(&args);
-  return cons(a, b);
+static value_t _cons(int argc, value_t *argv) {
+  return cons(Arg(0), Arg(1));
 }
 
-static value_t _car(value_t args) {
-  value_t a = next(&args);
-  return car(a);
+static value_t _car(int argc, value_t *argv) {
+  return car(Arg(0));
 }
 
-static value_t _cdr(value_t args) {
-  value_t a = next(&args);
-  return cdr(a);
+static value_t _cdr(int argc, value_t *argv) {
+  return cdr(Arg(0));
 }
 
-static value_t _set_car(value_t args) {
-  value_t a = next(&args);
-  value_t b = next(&args);
-  return Bool(set_car(a, b));
+static value_t _set_car(int argc, value_t *argv) {
+  return Bool(set_car(Arg(0), Arg(1)));
 }
 
-static value_t _set_cdr(value_t args) {
-  value_t a = next(&args);
-  value_t b = next(&args);
-  return Bool(set_cdr(a, b));
+static value_t _set_cdr(int argc, value_t *argv) {
+  return Bool(set_cdr(Arg(0), Arg(1)));
 }
 
-static value_t _add(value_t args) {
+static value_t _add(int argc, value_t *argv) {
   int sum = 0;
-  while (args.type == PairType) {
-    value_t value = next(&args);
-    if (value.type != IntegerType) return TypeError;
-    sum += value.data;
+  for (int i = 0; i < argc; i++) {
+    if (argv[i].type != IntegerType) return TypeError;
+    sum += argv[i].data;
   }
   return Integer(sum);
 }
 
-static value_t _sub(value_t args) {
-  value_t value = next(&args);
+static value_t _sub(int argc, value_t *argv) {
+  value_t value = Arg(0);
   if (value.type != IntegerType) return TypeError;
   int sum = value.data;
-  while (args.type == PairType) {
-    value = next(&args);
-    if (value.type != IntegerType) return TypeError;
-    sum -= value.data;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i].type != IntegerType) return TypeError;
+    sum -= argv[i].data;
   }
   return Integer(sum);
 }
 
-static value_t _mul(value_t args) {
+static value_t _mul(int argc, value_t *argv) {
   int product = 1;
-  while (args.type == PairType) {
-    value_t value = next(&args);
-    if (value.type != IntegerType) return TypeError;
-    product *= value.data;
+  for (int i = 0; i < argc; i++) {
+    if (argv[i].type != IntegerType) return TypeError;
+    product *= argv[i].data;
   }
   return Integer(product);
 }
 
-static value_t _div(value_t args) {
-  value_t value = next(&args);
+static value_t _div(int argc, value_t *argv) {
+  value_t value = Arg(0);
   if (value.type != IntegerType) return TypeError;
   int product = value.data;
-  while (args.type == PairType) {
-    value = next(&args);
-    if (value.type != IntegerType) return TypeError;
-    product /= value.data;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i].type != IntegerType) return TypeError;
+    product /= argv[i].data;
   }
   return Integer(product);
 }
 
-static value_t _mod(value_t args) {
-  value_t a = next(&args);
-  value_t b = next(&args);
+static value_t _mod(int argc, value_t *argv) {
+  value_t a = Arg(0);
+  value_t b = Arg(1);
   if (a.type != IntegerType || b.type != IntegerType) {
     return TypeError;
   }
   return Integer(a.data % b.data);
 }
 
-static value_t _lt(value_t args) {
-  value_t value = next(&args);
+static value_t _lt(int argc, value_t *argv) {
+  value_t value = Arg(0);
   if (value.type != IntegerType) return TypeError;
   int last = value.data;
-  while (args.type == PairType) {
-    value = next(&args);
-    if (value.type != IntegerType) return TypeError;
-    if (last >= value.data) return False;
-    last = value.data;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i].type != IntegerType) return TypeError;
+    if (last >= argv[i].data) return False;
+    last = argv[i].data;
   }
   return True;
 }
 
-static value_t _lte(value_t args) {
-  value_t value = next(&args);
+static value_t _lte(int argc, value_t *argv) {
+  value_t value = Arg(0);
   if (value.type != IntegerType) return TypeError;
   int last = value.data;
-  while (args.type == PairType) {
-    value = next(&args);
-    if (value.type != IntegerType) return TypeError;
-    if (last > value.data) return False;
-    last = value.data;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i].type != IntegerType) return TypeError;
+    if (last > argv[i].data) return False;
+    last = argv[i].data;
   }
   return True;
 }
 
-static value_t _gt(value_t args) {
-  value_t value = next(&args);
+static value_t _gt(int argc, value_t *argv) {
+  value_t value = Arg(0);
   if (value.type != IntegerType) return TypeError;
   int last = value.data;
-  while (args.type == PairType) {
-    value = next(&args);
-    if (value.type != IntegerType) return TypeError;
-    if (last <= value.data) return False;
-    last = value.data;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i].type != IntegerType) return TypeError;
+    if (last <= argv[i].data) return False;
+    last = argv[i].data;
   }
   return True;
 }
 
-static value_t _gte(value_t args) {
-  value_t value = next(&args);
+static value_t _gte(int argc, value_t *argv) {
+  value_t value = Arg(0);
   if (value.type != IntegerType) return TypeError;
   int last = value.data;
-  while (args.type == PairType) {
-    value = next(&args);
-    if (value.type != IntegerType) return TypeError;
-    if (last < value.data) return False;
-    last = value.data;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i].type != IntegerType) return TypeError;
+    if (last < argv[i].data) return False;
+    last = argv[i].data;
   }
   return True;
 }
 
-static value_t _eq(value_t args) {
-  value_t value = next(&args);
-  while (args.type == PairType) {
-    if (!eq(value, next(&args))) return False;
+static value_t _eq(int argc, value_t *argv) {
+  value_t value = Arg(0);
+  for (int i = 1; i < argc; i++) {
+    if (!eq(value, argv[i])) return False;
   }
   return True;
 }
 
-static value_t _neq(value_t args) {
-  value_t value = next(&args);
-  while (args.type == PairType) {
-    if (eq(value, next(&args))) return False;
+static value_t _neq(int argc, value_t *argv) {
+  value_t value = Arg(0);
+  for (int i = 1; i < argc; i++) {
+    if (eq(value, argv[i])) return False;
   }
   return True;
 }
@@ -340,27 +454,119 @@ static value_t _print(value_t args) {
   return Undefined;
 }
 
-static value_t _eval(value_t args) {
-  value_t code = next(&args);
-  value_t env = next(&args);
-  return eval(env, code);
+// (print-limit depth length value...) prints values with lists nested
+// deeper than depth or longer than length cut short, 0 for no limit.
+static value_t _print_limit(int argc, value_t *argv) {
+  if (argc < 2 || argv[0].type != IntegerType || argv[1].type != IntegerType ||
+      argv[0].data < 0 || argv[1].data < 0) {
+    return TypeError;
+  }
+  dump_limited(list_of(argc - 2, argv + 2), (dump_limits_t){
+    .depth = argv[0].data,
+    .length = argv[1].data,
+  });
+  return Undefined;
 }
 
-static value_t _is_list(value_t args) {
-  return Bool(is_list(next(&args)));
+// Print numbers after the width as columns, zero padded hex or right
+// aligned decimal.
+static value_t print_columns(int argc, value_t *argv, bool hex) {
+  if (!argc || argv[0].type != IntegerType) return TypeError;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i].type != IntegerType) return TypeError;
+  }
+  for (int i = 1; i < argc; i++) {
+    if (i > 1) print_char(' ');
+    hex ?
+      print_hex((unsigned)argv[i].data, argv[0].data) :
+      print_int_width(argv[i].data, argv[0].data);
+  }
+  print_char('\n');
+  return Undefined;
 }
-static value_t _list_length(value_t args) {
-  value_t list = next(&args);
+
+static value_t _print_hex(int argc, value_t *argv) {
+  return print_columns(argc, argv, true);
+}
+
+static value_t _print_dec(int argc, value_t *argv) {
+  return print_columns(argc, argv, false);
+}
+
+// Write out all pending output and report on it.
+static value_t _flush(int argc, value_t *argv) {
+  (void)argc;
+  (void)argv;
+  print_stats_t stats = print_wait();
+  value_t table = table_set(Nil, Symbol("slowest-write"),
+    Integer((int)stats.slowest_write));
+  return table_set(table, Symbol("dropped"), Integer((int)stats.dropped));
+}
+
+static value_t _eval(int argc, value_t *argv) {
+  return eval(Arg(1), Arg(0));
+}
+
+// (read text) -> forms, type-error if text ends inside a form
+static value_t _read(int argc, value_t *argv) {
+  value_t text = Arg(0);
+  if (text.type == PairType && eq(car(text), quoteSym)) text = cdr(text);
+  if (text.type != SymbolType) return TypeError;
+  const char *data = symbols_get_name(text.data);
+  size_t len = 0;
+  while (data[len]) len++;
+  parser_t parser = Parser();
+  parser_feed(&parser, data, len);
+  const char *problem;
+  value_t forms = parser_end(&parser, &problem);
+  return problem ? TypeError : forms;
+}
+
+// (encode value) -> bytes, see src/encode.c
+// type-error for a value that couldn't be decoded again
+static value_t _encode(int argc, value_t *argv) {
+  bytes_t bytes = {0};
+  if (!encode(Arg(0), &bytes)) return TypeError;
+  value_t list = Nil;
+  for (size_t i = bytes.len; i-- > 0;) list = cons(Integer(bytes.data[i]), list);
+  free(bytes.data);
+  return list;
+}
+
+// (decode bytes) -> value
+static value_t _decode(int argc, value_t *argv) {
+  value_t list = Arg(0);
+  if (!is_list(list)) return TypeError;
+  bytes_t bytes = {0};
+  while (list.type == PairType) {
+    value_t byte = next(&list);
+    if (byte.type != IntegerType || byte.data < 0 || byte.data > 255) {
+      free(bytes.data);
+      return TypeError;
+    }
+    bytes_put(&bytes, (uint8_t)byte.data);
+  }
+  value_t val;
+  long used = decode(bytes.data, bytes.len, &val);
+  free(bytes.data);
+  return used == (long)bytes.len ? val : TypeError;
+}
+
+static value_t _is_list(int argc, value_t *argv) {
+  return Bool(is_list(Arg(0)));
+}
+static value_t _list_length(int argc, value_t *argv) {
+  value_t list = Arg(0);
   if (!is_list(list)) return TypeError;
   return Integer(list_length(list));
 }
-static value_t _list_reverse(value_t args) {
-  value_t list = next(&args);
+static value_t _list_reverse(int argc, value_t *argv) {
+  value_t list = Arg(0);
   if (!is_list(list)) return TypeError;
   return list_reverse(list);
 }
-static value_t _list_ireverse(value_t args) {
-  value_t list = next(&args);
+static value_t _list_ireverse(int argc, value_t *argv) {
+  value_t list = Arg(0);
   if (!is_list(list)) return TypeError;
   return list_ireverse(list);
 }
@@ -369,88 +575,129 @@ static value_t _list_append(value_t args) {
   if (!is_list(list)) return TypeError;
   return list_append(list, args);
 }
-static value_t _list_concat(value_t args) {
-  value_t lists = Nil;
-  while (args.type == PairType) {
-    value_t list = next(&args);
-    if (!is_list(list)) return TypeError;
-    lists = cons(list, lists);
+static value_t _list_concat(int argc, value_t *argv) {
+  for (int i = 0; i < argc; i++) {
+    if (!is_list(argv[i])) return TypeError;
   }
   value_t combined = Nil;
-  while (lists.type == PairType) {
-    combined = list_append(next(&lists), combined);
+  for (int i = argc - 1; i >= 0; i--) {
+    combined = list_append(argv[i], combined);
   }
   return combined;
 }
 
-static value_t _list_sort(value_t args) {
-  value_t list = next(&args);
+static value_t _list_sort(int argc, value_t *argv) {
+  value_t list = Arg(0);
   if (!is_list(list)) return TypeError;
   return list_sort(list);
 }
 
-static value_t _list_iget(value_t args) {
-  value_t list = next(&args);
+static value_t _list_iget(int argc, value_t *argv) {
+  value_t list = Arg(0);
   if (!is_list(list)) return TypeError;
-  value_t index = next(&args);
+  value_t index = Arg(1);
   if (index.type != IntegerType) return TypeError;
   return list_get(list, index.data);
 }
 
-static value_t _list_iset(value_t args) {
-  value_t list = next(&args);
+static value_t _list_iset(int argc, value_t *argv) {
+  value_t list = Arg(0);
   if (!is_list(list)) return TypeError;
-  value_t index = next(&args);
+  value_t index = Arg(1);
   if (index.type != IntegerType) return TypeError;
-  value_t value = next(&args);
-  return list_set(list, index.data, value);
+  return list_set(list, index.data, Arg(2));
 }
 
-static value_t _list_has(value_t args) {
-  value_t list = next(&args);
+static value_t _list_has(int argc, value_t *argv) {
+  value_t list = Arg(0);
   if (!is_list(list)) return TypeError;
-  while (args.type == PairType) {
-    if (!list_has(list, next(&args))) return False;
+  for (int i = 1; i < argc; i++) {
+    if (!list_has(list, argv[i])) return False;
   }
   return True;
 }
 
-static value_t _list_add(value_t args) {
-  value_t list = next(&args);
+static value_t _list_add(int argc, value_t *argv) {
+  value_t list = Arg(0);
   if (!is_list(list)) return TypeError;
-  while (args.type == PairType) {
-    list = list_add(list, next(&args));
+  for (int i = 1; i < argc; i++) {
+    list = list_add(list, argv[i]);
   }
   return list;
 }
 
-static value_t _list_remove(value_t args) {
-  value_t list = next(&args);
+static value_t _list_remove(int argc, value_t *argv) {
+  value_t list = Arg(0);
   if (!is_list(list)) return TypeError;
-  while (args.type == PairType) {
-    list = list_remove(list, next(&args));
+  for (int i = 1; i < argc; i++) {
+    list = list_remove(list, argv[i]);
   }
   return list;
 }
 
 
+// Builtin names evaluate to themselves, binding one would never be seen.
+static bool is_builtin(value_t key) {
+  return key.type == SymbolType && key.data >= 0;
+}
+
 // Define a function
 static value_t _def(value_t args) {
   value_t env = next(&args);
   value_t key = next(&args);
+  if (is_builtin(key)) return TypeError;
+  value_t fn = copy(args);
+  optimize_fn(fn);
+  // Compiled before it's bound, so callers recompiled by the write can
+  // inline the new body.
+  code_compile(fn, Nil);
   is_list(key) ?
-    table_aset(env, key, copy(args)) :
-    table_set(env, key, copy(args));
+    table_aset(env, key, fn) :
+    table_set(env, key, fn);
   return key;
 }
 
+// Returns a closure over the variables of the current environment the
+// body refers to.  Unbound ones are looked up when it runs.
+static value_t _lambda(value_t args) {
+  value_t env = next(&args);
+  value_t names = free_names(args);
+  value_t captures = Nil;
+  for (value_t node = names; node.type == PairType; node = cdr(node)) {
+    value_t name = car(node);
+    value_t mapping = eq(env, globals) ? Nil : table_mapping(env, name);
+    captures = list_add(captures,
+      cons(name, isNil(mapping) ? EmptySlot : cdr(mapping)));
+  }
+  if (vm_enabled) code_compile(args, names);
+  return cons(ClosureTag, cons(captures, args));
+}
+
 static value_t _do(value_t args) {
   value_t env = next(&args);
   return block(env, args);
 }
 
-static value_t _is_table(value_t args) {
-  return Bool(is_table(next(&args)));
+static value_t _if(value_t args) {
+  value_t env = next(&args);
+  value_t cond = eval(env, next(&args));
+  value_t if_true = next(&args);
+  value_t if_false = next(&args);
+  return eval(env, isTruthy(cond) ? if_true : if_false);
+}
+
+static value_t _while(value_t args) {
+  value_t env = next(&args);
+  value_t cond = next(&args);
+  value_t result = Undefined;
+  while (isTruthy(eval(env, cond))) {
+    result = block(env, args);
+  }
+  return result;
+}
+
+static value_t _is_table(int argc, value_t *argv) {
+  return Bool(is_table(Arg(0)));
 }
 
 static value_t _get(value_t args) {
@@ -458,13 +705,13 @@ static value_t _get(value_t args) {
   value_t key = eval(env, next(&args));
   return is_list(key) ?
     table_aget(env, key) :
-    table_get(env, key);
+    lookup(env, key);
 }
 
-static value_t _table_get(value_t args) {
-  value_t table = next(&args);
+static value_t _table_get(int argc, value_t *argv) {
+  value_t table = Arg(0);
   if (!is_table(table)) return TypeError;
-  value_t key = next(&args);
+  value_t key = Arg(1);
   return is_list(key) ?
     table_aget(table, key) :
     table_get(table, key);
@@ -483,11 +730,11 @@ static value_t _has(value_t args) {
   return True;
 }
 
-static value_t _table_has(value_t args) {
-  value_t table = next(&args);
+static value_t _table_has(int argc, value_t *argv) {
+  value_t table = Arg(0);
   if (!is_table(table)) return TypeError;
-  while (args.type == PairType) {
-    value_t key = next(&args);
+  for (int i = 1; i < argc; i++) {
+    value_t key = argv[i];
     if (!(is_list(key) ?
         table_ahas(table, key) :
         table_has(table, key))) {
@@ -502,6 +749,7 @@ static value_t _set(value_t args) {
   value_t value = Undefined;
   while (args.type == PairType) {
     value_t key = eval(env, next(&args));
+    if (is_builtin(key)) return TypeError;
     value = eval(env, next(&args));
     is_list(key) ?
       table_aset(env, key, value) :
@@ -510,12 +758,12 @@ static value_t _set(value_t args) {
   return value;
 }
 
-static value_t _table_set(value_t args) {
-  value_t table = next(&args);
+static value_t _table_set(int argc, value_t *argv) {
+  value_t table = Arg(0);
   if (!is_table(table)) return TypeError;
-  while (args.type == PairType) {
-    value_t key = next(&args);
-    value_t value = next(&args);
+  for (int i = 1; i < argc; i += 2) {
+    value_t key = argv[i];
+    value_t value = Arg(i + 1);
     table = is_list(key) ?
       table_aset(table, key, value) :
       table_set(table, key, value);
@@ -534,11 +782,11 @@ static value_t _del(value_t args) {
   return Undefined;
 }
 
-static value_t _table_del(value_t args) {
-  value_t table = next(&args);
+static value_t _table_del(int argc, value_t *argv) {
+  value_t table = Arg(0);
   if (!is_table(table)) return TypeError;
-  while (args.type == PairType) {
-    value_t key = next(&args);
+  for (int i = 1; i < argc; i++) {
+    value_t key = argv[i];
     table = is_list(key) ?
       table_adel(table, key) :
       table_del(table, key);
@@ -546,165 +794,563 @@ static value_t _table_del(value_t args) {
   return table;
 }
 
-static void each_callback(value_t ctx, value_t item) {
-  set_cdr(ctx, apply(car(ctx), item));
+static bool each_callback(value_t ctx, int index, value_t item) {
+  (void)index;
+  set_cdr(ctx, call(car(ctx), 1, &item));
+  return true;
 }
 
-static value_t _iter_each(value_t args) {
-  value_t iter = next(&args);
-  value_t fn = next(&args);
-  value_t ctx = cons(fn, Undefined);
-  iter_any(iter, ctx, each_callback);
+static value_t _iter_each(int argc, value_t *argv) {
+  value_t ctx = cons(Arg(1), Undefined);
+  iter_any(Arg(0), ctx, each_callback);
   return free_cell(ctx).right;
 }
 
-static void map_callback(value_t ctx, value_t item) {
-  set_cdr(ctx, cons(apply(car(ctx), item), cdr(ctx)));
+static bool map_callback(value_t ctx, int index, value_t item) {
+  (void)index;
+  set_cdr(ctx, cons(call(car(ctx), 1, &item), cdr(ctx)));
+  return true;
 }
 
-static value_t _iter_map(value_t args) {
-  value_t iter = next(&args);
-  value_t fn = next(&args);
-  value_t ctx = cons(fn, Nil);
-  iter_any(iter, ctx, map_callback);
+// Over a stream map and filter add a stage to it instead of running.
+static value_t _iter_map(int argc, value_t *argv) {
+  if (is_stream(Arg(0))) return stream_add(Arg(0), mapSym, Arg(1));
+  value_t ctx = cons(Arg(1), Nil);
+  iter_any(Arg(0), ctx, map_callback);
   return list_ireverse(free_cell(ctx).right);
 }
 
-static void filter_callback(value_t ctx, value_t item) {
-  if (isTruthy(apply(car(ctx), item))) {
-    set_cdr(ctx, cons(car(item), cdr(ctx)));
+static bool filter_callback(value_t ctx, int index, value_t item) {
+  (void)index;
+  if (isTruthy(call(car(ctx), 1, &item))) {
+    set_cdr(ctx, cons(item, cdr(ctx)));
   }
+  return true;
 }
 
-static value_t _iter_filter(value_t args) {
-  value_t iter = next(&args);
-  value_t fn = next(&args);
-  value_t ctx = cons(fn, Nil);
-  iter_any(iter, ctx, filter_callback);
+static value_t _iter_filter(int argc, value_t *argv) {
+  if (is_stream(Arg(0))) return stream_add(Arg(0), filterSym, Arg(1));
+  value_t ctx = cons(Arg(1), Nil);
+  iter_any(Arg(0), ctx, filter_callback);
   return list_ireverse(free_cell(ctx).right);
 }
 
-static value_t _if(value_t args) {
-  value_t cond = next(&args);
-  value_t if_true = next(&args);
-  value_t if_false = next(&args);
-  return (eq(cond, True)) ? if_true : if_false;
+// ctx is (count . taken), a negative count takes everything.
+static bool take_callback(value_t ctx, int index, value_t item) {
+  set_cdr(ctx, cons(item, cdr(ctx)));
+  return index + 1 != car(ctx).data;
 }
 
-static value_t _apply(value_t args) {
-  value_t fn = next(&args);
-  value_t list = next(&args);
+static value_t _iter_take(int argc, value_t *argv) {
+  value_t count = argc > 1 ? argv[1] : Integer(-1);
+  if (count.type != IntegerType) return TypeError;
+  if (!count.data) return Nil;
+  value_t ctx = cons(count, Nil);
+  iter_any(Arg(0), ctx, take_callback);
+  return list_ireverse(free_cell(ctx).right);
+}
+
+// ctx is (acc . fn), acc being an empty slot until the first item when
+// there's no initial value.
+static bool reduce_callback(value_t ctx, int index, value_t item) {
+  (void)index;
+  pair_t pair = get_pair(ctx);
+  value_t args[] = { pair.left, item };
+  set_car(ctx, eq(pair.left, EmptySlot) ? item : call(pair.right, 2, args));
+  return true;
+}
+
+static value_t _iter_reduce(int argc, value_t *argv) {
+  value_t ctx = cons(argc > 2 ? argv[2] : EmptySlot, Arg(1));
+  iter_any(Arg(0), ctx, reduce_callback);
+  value_t acc = free_cell(ctx).left;
+  return eq(acc, EmptySlot) ? Undefined : acc;
+}
+
+// The aggregates keep their result in the car of ctx and stop at the
+// first item that isn't a number.
+static bool sum_callback(value_t ctx, int index, value_t item) {
+  (void)index;
+  if (item.type != IntegerType) {
+    set_car(ctx, TypeError);
+    return false;
+  }
+  set_car(ctx, Integer(car(ctx).data + item.data));
+  return true;
+}
+
+static value_t _iter_sum(int argc, value_t *argv) {
+  value_t ctx = cons(Integer(0), Nil);
+  iter_any(Arg(0), ctx, sum_callback);
+  return free_cell(ctx).left;
+}
+
+// ctx is (best . max?)
+static bool extreme_callback(value_t ctx, int index, value_t item) {
+  pair_t pair = get_pair(ctx);
+  if (item.type != IntegerType) {
+    set_car(ctx, TypeError);
+    return false;
+  }
+  if (!index || (isTruthy(pair.right) ?
+      item.data > pair.left.data : item.data < pair.left.data)) {
+    set_car(ctx, item);
+  }
+  return true;
+}
+
+static value_t _iter_min(int argc, value_t *argv) {
+  value_t ctx = cons(Undefined, False);
+  iter_any(Arg(0), ctx, extreme_callback);
+  return free_cell(ctx).left;
+}
+
+static value_t _iter_max(int argc, value_t *argv) {
+  value_t ctx = cons(Undefined, True);
+  iter_any(Arg(0), ctx, extreme_callback);
+  return free_cell(ctx).left;
+}
+
+// ctx is (count . fn), fn being undefined to count every item.
+static bool count_callback(value_t ctx, int index, value_t item) {
+  (void)index;
+  pair_t pair = get_pair(ctx);
+  if (eq(pair.right, Undefined) || isTruthy(call(pair.right, 1, &item))) {
+    set_car(ctx, Integer(pair.left.data + 1));
+  }
+  return true;
+}
+
+static value_t _iter_count(int argc, value_t *argv) {
+  value_t ctx = cons(Integer(0), Arg(1));
+  iter_any(Arg(0), ctx, count_callback);
+  return free_cell(ctx).left;
+}
+
+// Like map and filter but spread over threads when fn is safe to run in
+// parallel, see parallel.c.
+static value_t _iter_pmap(int argc, value_t *argv) {
+  value_t items = Arg(0);
+  if (!is_list(items) || is_stream(items)) items = _iter_take(1, argv);
+  return par_map(Arg(1), items, false);
+}
+
+static value_t _iter_pfilter(int argc, value_t *argv) {
+  value_t items = Arg(0);
+  if (!is_list(items) || is_stream(items)) items = _iter_take(1, argv);
+  return par_map(Arg(1), items, true);
+}
+
+static value_t _iter_stream(int argc, value_t *argv) {
+  return stream_of(Arg(0));
+}
+
+static value_t _apply(int argc, value_t *argv) {
+  value_t list = Arg(1);
   if (!is_list(list)) return TypeError;
-  return apply(fn, list);
+  return apply(Arg(0), list);
 }
 
-static value_t _next(value_t args) {
-  return next(&args);
+static value_t _next(int argc, value_t *argv) {
+  return Arg(0);
 }
 
-static value_t _not(value_t args) {
-  return Bool(!isTruthy(next(&args)));
+static value_t _not(int argc, value_t *argv) {
+  return Bool(!isTruthy(Arg(0)));
 }
 
-static value_t _or(value_t args) {
-  while (args.type == PairType) {
-    if (isTruthy(next(&args))) return True;
+static value_t _or(int argc, value_t *argv) {
+  for (int i = 0; i < argc; i++) {
+    if (isTruthy(argv[i])) return True;
   }
   return False;
 }
 
-static value_t _and(value_t args) {
-  while (args.type == PairType) {
-    if (!isTruthy(next(&args))) return False;
+static value_t _and(int argc, value_t *argv) {
+  for (int i = 0; i < argc; i++) {
+    if (!isTruthy(argv[i])) return False;
   }
   return True;
 }
 
-static value_t _xor(value_t args) {
-  return Bool(isTruthy(next(&args)) ^ isTruthy(next(&args)));
+static value_t _xor(int argc, value_t *argv) {
+  return Bool(isTruthy(Arg(0)) ^ isTruthy(Arg(1)));
 }
 
+#if defined(BENCH) || defined(TEST)
+// Parse source text into a list of forms.
+static value_t read_forms(const char *data) {
+  parser_t parser = Parser();
+  size_t len = 0;
+  while (data[len]) len++;
+  parser_feed(&parser, data, len);
+  return parser_end(&parser, 0);
+}
+#endif
+
+#ifdef TEST
+#include "test.c"
+#endif
+
+#ifdef BENCH
+#include <time.h>  // for clock
+
+typedef struct {
+  const char *name;
+  const char *setup; // evaluated once before timing
+  const char *run;   // timed, once with the tree-walker and once compiled
+} bench_t;
+
+static const bench_t *benchmarks = (const bench_t[]){
+  {"fib",
+    "(def fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))",
+    "(fib 27)"},
+  {"loop",
+    "(def sum-to (n) (set 'i 0 's 0)"
+    " (while (< i n) (set 's (+ s i) 'i (+ i 1))) s)",
+    "(sum-to 1000000)"},
+  {"table",
+    "(set 'tab '((a . 1) (b . 2) (c . 3) (d . 4)))"
+    "(def sum-d (t n) (set 'i 0 's 0)"
+    " (while (< i n) (set 's (+ s (t-get t 'd)) 'i (+ i 1))) s)",
+    "(sum-d tab 1000000)"},
+  // Small helpers are inlined into compiled callers.
+  {"inline",
+    "(def odd (n) (= 1 (% n 2)))"
+    "(def count-odd (n) (set 'c 0)"
+    " (while (< 0 n) (if (odd n) (set 'c (+ c 1))) (set 'n (- n 1))) c)",
+    "(count-odd 1000000)"},
+  // Many short calls, so the jit has something to do.
+  {"hot",
+    "(def step (i s) (while (< 0 i) (set 's (+ s i) 'i (- i 1))) s)"
+    "(def hot (n) (set 'r 0) (while (< 0 n) (set 'r (step 100 r) 'n (- n 1))) r)",
+    "(hot 20000)"},
+  // Tail calls must run in constant stack in both evaluators.
+  {"countdown",
+    "(def countdown (n) (if (= n 0) 'done (countdown (- n 1))))",
+    "(countdown 1000000)"},
+  // Deeper than VM_FRAMES, the vm hands the rest to the tree-walker.
+  {"deep",
+    "(def sumto (n) (if (= n 0) 0 (+ n (sumto (- n 1)))))",
+    "(sumto 2000)"},
+  // Variables set in a function without params.
+  {"locals",
+    "(def locals () (set 'x (car '(5))) (+ x 1))",
+    "(locals)"},
+  {0,0,0},
+};
+
+// Evaluate forms and return the elapsed cpu time in milliseconds.
+static long bench_time(value_t forms, value_t *result) {
+  clock_t start = clock();
+  while (forms.type == PairType) {
+    *result = eval(repl, next(&forms));
+  }
+  return (long)((clock() - start) * 1000 / CLOCKS_PER_SEC);
+}
+
+#ifdef THREADS
+// pmap of a function that is safe to spread over threads, by wall clock
+// time as cpu time adds up across threads.
+static void bench_threads() {
+  value_t result;
+  bench_time(read_forms(
+    "(def spin (n) (set 'i 0) (while (< i 5000) (set 'i (+ i 1))) (+ n i))"),
+    &result);
+  value_t forms = read_forms("(pmap 4000 spin)");
+  for (int threads = 1; threads <= 4; threads *= 2) {
+    par_threads = threads;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bench_time(forms, &result);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    print("pmap: ");
+    print_int(threads);
+    print(" threads ");
+    print_int((int)((end.tv_sec - start.tv_sec) * 1000 +
+      (end.tv_nsec - start.tv_nsec) / 1000000));
+    print("ms, result ");
+    dump(car(result));
+  }
+  par_threads = PAR_THREADS;
+}
+#endif
+
+// Dump a 100k item list into /dev/null, as one line and a line per item,
+// line buffered and fully buffered.
+static void bench_print() {
+  value_t items = Integer(100000);
+  value_t list = _iter_take(1, &items);
+  int out = dup(1);
+  int null = open("/dev/null", O_WRONLY);
+  long times[2][2];
+  for (int mode = 0; mode < 2; mode++) {
+    // Earlier results may still be buffered, they go out before stdout is
+    // pointed elsewhere.
+    print_wait();
+    print_mode = mode ? PRINT_FULL : PRINT_LINE;
+    dup2(null, 1);
+    clock_t start = clock();
+    dump(list);
+    print_wait();
+    times[mode][0] = (long)((clock() - start) * 1000 / CLOCKS_PER_SEC);
+    start = clock();
+    for (value_t node = list; node.type == PairType; node = cdr(node)) {
+      dump(car(node));
+    }
+    print_wait();
+    times[mode][1] = (long)((clock() - start) * 1000 / CLOCKS_PER_SEC);
+    dup2(out, 1);
+  }
+  // Every entry is a pair of its own the cycle check has to keep track of.
+  value_t table = Nil;
+  for (int i = 0; i < 50000; i++) {
+    table = cons(cons(Integer(i), Integer(i)), table);
+  }
+  print_wait();
+  dup2(null, 1);
+  clock_t start = clock();
+  dump(table);
+  print_wait();
+  long table_time = (long)((clock() - start) * 1000 / CLOCKS_PER_SEC);
+  dup2(out, 1);
+  close(null);
+  close(out);
+  print_mode = PRINT_MODE;
+  for (int mode = 0; mode < 2; mode++) {
+    print(mode ? "print full: " : "print line: ");
+    print_int((int)times[mode][0]);
+    print("ms one line, ");
+    print_int((int)times[mode][1]);
+    print("ms line per item\n");
+  }
+  print("print table: ");
+  print_int((int)table_time);
+  print("ms for 50000 entries\n");
+}
+
+// Parse a generated file of a few megabytes through the same mapping and
+// slicing as scripts, without running it.
+static void bench_parse() {
+  static const char shape[] =
+    "(def area (shape)\n"
+    "  (if (= (t-get shape 'kind) 'circle)\n"
+    "      (* 3 (t-get shape 'radius) (t-get shape 'radius))\n"
+    "      [(t-get shape 'width) -42 \"a string with spaces\" shape.size]))\n";
+  const char *path = "/tmp/ujkl-bench-parse";
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) return;
+  unlink(path);
+  for (int i = 0; i < 20000; i++) {
+    if (write(fd, shape, sizeof(shape) - 1) < 0) break;
+  }
+  size_t size;
+  const char *map = source_map(fd, &size);
+  close(fd);
+  if (!map) return;
+  // Forms cut off at the end of a slice are promoted and freed later on,
+  // don't dump them.
+  gc_log = false;
+  clock_t start = clock();
+  for (size_t at = 0; at < size; at += MAP_SLICE_LENGTH) {
+    region_begin();
+    size_t len = size - at < MAP_SLICE_LENGTH ? size - at : MAP_SLICE_LENGTH;
+    parser_feed(&reader, map + at, len);
+    parser_take(&reader);
+    region_end(repl);
+  }
+  long ms = (long)((clock() - start) * 1000 / CLOCKS_PER_SEC);
+  gc_log = true;
+  munmap((void *)map, size);
+  print("parse: ");
+  print_int((int)(size / 1000));
+  print("kB in ");
+  print_int((int)ms);
+  print("ms, ");
+  print_int(ms ? (int)(size / 1000 / (size_t)ms) : 0);
+  print(" MB/s\n");
+}
+
+static void bench() {
+  for (const bench_t *b = benchmarks; b->name; b++) {
+    value_t result;
+    bench_time(read_forms(b->setup), &result);
+    value_t forms = read_forms(b->run);
+    vm_enabled = false;
+    long walked = bench_time(forms, &result);
+    value_t expected = result;
+    vm_enabled = true;
+#ifdef JIT
+    jit_enabled = false;
+#endif
+    long compiled = bench_time(forms, &result);
+    print(b->name);
+    print(": tree ");
+    print_int((int)walked);
+    print("ms, vm ");
+    print_int((int)compiled);
+#ifdef JIT
+    jit_enabled = true;
+    bench_time(forms, &result); // warm up past JIT_THRESHOLD
+    long jitted = bench_time(forms, &result);
+    print("ms, jit ");
+    print_int((int)jitted);
+#endif
+    print("ms, result ");
+    dump(result);
+    // Both evaluators must agree.
+    if (!eq(result, expected)) {
+      print(b->name);
+      print(": tree-walker gave ");
+      dump(expected);
+    }
+  }
+#ifdef THREADS
+  bench_threads();
+#endif
+  bench_print();
+  bench_parse();
+}
+#endif
+
 static const builtin_t *functions = (const builtin_t[]){
-  {"get", _get},
-  {"has", _has},
-  {"del", _del},
-  {"set", _set},
-  {"def", _def},
-  {"do", _do},
-  // if
+  {"get", _get, 0},
+  {"has", _has, 0},
+  {"del", _del, 0},
+  {"set", _set, 0},
+  {"def", _def, 0},
+  {"do", _do, 0},
+  {"if", _if, 0},
   // else-if
   // else
-  // while
-  {"quote", _quote},
+  {"while", _while, 0},
+  {"lambda", _lambda, 0},
+  {"quote", _quote, 0},
   /////////////////////
 
-  {"list", _list},
-  {"print", _print},
-  {"eval", _eval},
-
-  {"cons", _cons},
-  {"car", _car},
-  {"cdr", _cdr},
-  {"set-car", _set_car},
-  {"set-cdr", _set_cdr},
-
-  {"table?", _is_table},
-  {"t-get", _table_get},
-  {"t-has", _table_has},
-  {"t-del!", _table_del},
-  {"t-set!", _table_set},
-
-  {"list?", _is_list},
-  {"length?", _list_length},
-  {"reverse", _list_reverse},
-  {"reverse!", _list_ireverse},
-  {"append!", _list_append},
-  {"concat!", _list_concat},
-  {"sort", _list_sort},
-  {"iget", _list_iget},
-  {"iset!", _list_iset},
-  {"has?", _list_has},
-  {"add!", _list_add},
-  {"remove!", _list_remove},
-
-  {"+", _add},
-  {"-", _sub},
-  {"*", _mul},
-  {"/", _div},
-  {"%", _mod},
-  {"<", _lt},
-  {"<=", _lte},
-  {">", _gt},
-  {">=", _gte},
-  {"=", _eq},
-  {"!=", _neq},
-
-  {"each", _iter_each},
-  {"map", _iter_map},
-  {"filter", _iter_filter},
-
-  {"if", _if},
-  {"apply", _apply},
-  {"next", _next},
-
-  {"!", _not},
-  {"|", _or},
-  {"&", _and},
-  {"^", _xor},
-
-  {0,0},
+  {"list", _list, 0},
+  {"print", _print, 0},
+  {"print-hex", 0, _print_hex},
+  {"print-dec", 0, _print_dec},
+  {"print-limit", 0, _print_limit},
+  {"flush", 0, _flush},
+  {"eval", 0, _eval},
+  {"read", 0, _read},
+  {"encode", 0, _encode},
+  {"decode", 0, _decode},
+
+  {"cons", 0, _cons},
+  {"car", 0, _car},
+  {"cdr", 0, _cdr},
+  {"set-car", 0, _set_car},
+  {"set-cdr", 0, _set_cdr},
+
+  {"table?", 0, _is_table},
+  {"t-get", 0, _table_get},
+  {"t-has", 0, _table_has},
+  {"t-del!", 0, _table_del},
+  {"t-set!", 0, _table_set},
+
+  {"list?", 0, _is_list},
+  {"length?", 0, _list_length},
+  {"reverse", 0, _list_reverse},
+  {"reverse!", 0, _list_ireverse},
+  {"append!", _list_append, 0},
+  {"concat!", 0, _list_concat},
+  {"sort", 0, _list_sort},
+  {"iget", 0, _list_iget},
+  {"iset!", 0, _list_iset},
+  {"has?", 0, _list_has},
+  {"add!", 0, _list_add},
+  {"remove!", 0, _list_remove},
+
+  {"+", 0, _add},
+  {"-", 0, _sub},
+  {"*", 0, _mul},
+  {"/", 0, _div},
+  {"%", 0, _mod},
+  {"<", 0, _lt},
+  {"<=", 0, _lte},
+  {">", 0, _gt},
+  {">=", 0, _gte},
+  {"=", 0, _eq},
+  {"!=", 0, _neq},
+
+  {"each", 0, _iter_each},
+  {"map", 0, _iter_map},
+  {"filter", 0, _iter_filter},
+  {"take", 0, _iter_take},
+  {"stream", 0, _iter_stream},
+  {"reduce", 0, _iter_reduce},
+  {"sum", 0, _iter_sum},
+  {"min", 0, _iter_min},
+  {"max", 0, _iter_max},
+  {"count", 0, _iter_count},
+  {"pmap", 0, _iter_pmap},
+  {"pfilter", 0, _iter_pfilter},
+
+  {"apply", 0, _apply},
+  {"next", 0, _next},
+
+  {"!", 0, _not},
+  {"|", 0, _or},
+  {"&", 0, _and},
+  {"^", 0, _xor},
+
+  {0,0,0},
 };
 
-int main() {
+int main(int argc, char **argv) {
+  gc_stack(&argc);
   // Initialize symbol system with our builtins.
-  symbols_init(functions, 7);
+  symbols_init(functions, 10);
   quoteSym = Symbol("quote");
   listSym = Symbol("list");
+  getSym = Symbol("get");
+  setSym = Symbol("set");
+  doSym = Symbol("do");
+  ifSym = Symbol("if");
+  whileSym = Symbol("while");
+  lambdaSym = Symbol("lambda");
+  mapSym = Symbol("map");
+  filterSym = Symbol("filter");
+  takeSym = Symbol("take");
+  streamSym = Symbol("stream");
 
   // Initialize repl environment with a version variable and ref to self.
   repl = table_set(Nil, Symbol("env"), Nil);
   table_set(repl, Symbol("env"), repl);
   table_set(repl, Symbol("version"), Symbol(VM_VERSION));
+  globals = repl;
+
+  reader = Parser();
+  gc_keep(&reader.stack);
+  gc_keep(&reader.value);
+
+#ifdef TEST
+  (void)argc;
+  (void)argv;
+  int failures = test();
+  print_wait();
+  return failures ? 1 : 0;
+#endif
+
+#ifdef BENCH
+  (void)argc;
+  (void)argv;
+  bench();
+  print_wait();
+  return 0;
+#endif
+
+  // Scripts given on the command line run headless.
+  if (argc > 1) {
+    gc_log = false;
+    bool ok = true;
+    for (int i = 1; ok && i < argc; i++) ok = run_script(argv[i]);
+    print_wait();
+    return ok ? 0 : 1;
+  }
 
   const char** lines = (const char*[]) {
     "(def *10 (n) (* n 10))",
@@ -0,0 +1,590 @@
+#ifndef COMPILER_C
+#define COMPILER_C
+
+#include "types.h"
+#include <stdlib.h> // for realloc, calloc and free
+
+// Compiles the body of a `def`-ed function or lambda into bytecode for the
+// vm.  Only part of the language is supported: anything needing a real
+// environment table (has, del, def or computed keys in get/set) makes the
+// compile fail and the function stays with the tree-walking evaluator.
+
+typedef struct {
+  code_t *code;
+  int ops_len;    // allocated length of code->ops
+  int consts_len; // allocated length of code->consts
+  int names_len;  // allocated length of code->names
+  int depth;      // current operand stack depth
+  int scope;      // first local slot visible by name
+  bool inlining;  // compiling the body of an inlined function
+  bool hidden[UINT8_MAX + 1]; // slots of inlined bodies, done with
+  bool failed;
+} compiler_t;
+
+static code_t *codes[CODE_BUCKETS];
+// Stale code may still be running, so it's only freed by code_sweep.
+static code_t *retired;
+
+static void grow(compiler_t *c, int n) {
+  c->depth += n;
+  if (c->depth > c->code->max_stack) c->code->max_stack = c->depth;
+}
+
+static void emit(compiler_t *c, uint8_t byte) {
+  code_t *code = c->code;
+  if (code->len == c->ops_len) {
+    c->ops_len += CODE_BLOCK_SIZE;
+    code->ops = realloc(code->ops, (size_t)c->ops_len);
+  }
+  code->ops[code->len++] = byte;
+}
+
+static void emit16(compiler_t *c, int word) {
+  emit(c, (uint8_t)(word & 0xff));
+  emit(c, (uint8_t)((word >> 8) & 0xff));
+}
+
+// Emit a jump with a placeholder offset and return where to patch it.
+static int emit_jump(compiler_t *c, opcode_t op) {
+  emit(c, op);
+  emit16(c, 0);
+  return c->code->len - 2;
+}
+
+static void patch_jump(compiler_t *c, int at) {
+  int offset = c->code->len - (at + 2);
+  if (offset > INT16_MAX) c->failed = true;
+  c->code->ops[at] = (uint8_t)(offset & 0xff);
+  c->code->ops[at + 1] = (uint8_t)((offset >> 8) & 0xff);
+}
+
+static void emit_loop(compiler_t *c, int target) {
+  emit(c, JMP);
+  int offset = target - (c->code->len + 2);
+  if (offset < INT16_MIN) c->failed = true;
+  emit16(c, offset);
+}
+
+static int add_const(compiler_t *c, value_t val) {
+  code_t *code = c->code;
+  for (int i = 0; i < code->num_consts; i++) {
+    if (eq(code->consts[i], val)) return i;
+  }
+  if (code->num_consts > UINT16_MAX) {
+    c->failed = true;
+    return 0;
+  }
+  if (code->num_consts == c->consts_len) {
+    c->consts_len += CODE_BLOCK_SIZE;
+    code->consts = realloc(code->consts, (size_t)c->consts_len * sizeof(value_t));
+  }
+  code->consts[code->num_consts] = val;
+  return code->num_consts++;
+}
+
+static int find_local(compiler_t *c, value_t name) {
+  for (int i = c->scope; i < c->code->num_locals; i++) {
+    if (!c->hidden[i] && eq(c->code->names[i], name)) return i;
+  }
+  return -1;
+}
+
+static int add_local(compiler_t *c, value_t name) {
+  int slot = find_local(c, name);
+  if (slot >= 0) return slot;
+  code_t *code = c->code;
+  if (code->num_locals > UINT8_MAX) {
+    c->failed = true;
+    return 0;
+  }
+  if (code->num_locals == c->names_len) {
+    c->names_len += CODE_BLOCK_SIZE;
+    code->names = realloc(code->names, (size_t)c->names_len * sizeof(value_t));
+  }
+  code->names[code->num_locals] = name;
+  return code->num_locals++;
+}
+
+static bool is_keyword(value_t val) {
+  return val.type == SymbolType && val.data >= 0 && val.data < first_fn;
+}
+
+// Matches 'name where name is a user symbol.
+static bool is_quoted_symbol(value_t val) {
+  if (val.type != PairType) return false;
+  pair_t pair = get_pair(val);
+  return eq(pair.left, quoteSym) &&
+    pair.right.type == SymbolType && pair.right.data < 0;
+}
+
+// Every `(set 'name ...)` in the body gets a local slot up front so reads
+// before the first set still see the same slot (and fall back to globals).
+static void scan_sets(compiler_t *c, value_t form) {
+  if (form.type != PairType) return;
+  value_t head = next(&form);
+  if (eq(head, quoteSym)) return;
+  if (eq(head, setSym)) {
+    while (form.type == PairType) {
+      value_t key = next(&form);
+      if (is_quoted_symbol(key)) add_local(c, cdr(key));
+      scan_sets(c, next(&form));
+    }
+    return;
+  }
+  scan_sets(c, head);
+  while (form.type == PairType) {
+    scan_sets(c, next(&form));
+  }
+}
+
+static void compile_expr(compiler_t *c, value_t form, bool tail);
+
+static void emit_lit(compiler_t *c, value_t val) {
+  emit(c, LIT);
+  emit16(c, add_const(c, val));
+  grow(c, 1);
+}
+
+static void compile_ref(compiler_t *c, value_t name) {
+  int slot = find_local(c, name);
+  if (slot >= 0) {
+    emit(c, GET);
+    emit(c, (uint8_t)slot);
+  }
+  else {
+    emit(c, GBL);
+    emit16(c, add_const(c, name));
+  }
+  grow(c, 1);
+}
+
+static void compile_block(compiler_t *c, value_t body, bool tail) {
+  if (body.type != PairType) {
+    emit_lit(c, Undefined);
+    return;
+  }
+  value_t expr = next(&body);
+  while (body.type == PairType) {
+    compile_expr(c, expr, false);
+    emit(c, DRP);
+    grow(c, -1);
+    expr = next(&body);
+  }
+  compile_expr(c, expr, tail);
+}
+
+static void compile_get(compiler_t *c, value_t args) {
+  value_t key = next(&args);
+  if (!is_quoted_symbol(key)) {
+    c->failed = true;
+    return;
+  }
+  compile_ref(c, cdr(key));
+}
+
+static void compile_set(compiler_t *c, value_t args) {
+  if (args.type != PairType) {
+    emit_lit(c, Undefined);
+    return;
+  }
+  bool first = true;
+  while (args.type == PairType) {
+    value_t key = next(&args);
+    if (!is_quoted_symbol(key)) {
+      c->failed = true;
+      return;
+    }
+    if (!first) {
+      emit(c, DRP);
+      grow(c, -1);
+    }
+    compile_expr(c, next(&args), false);
+    emit(c, SET);
+    emit(c, (uint8_t)add_local(c, cdr(key)));
+    first = false;
+  }
+}
+
+static void compile_if(compiler_t *c, value_t args, bool tail) {
+  compile_expr(c, next(&args), false);
+  int otherwise = emit_jump(c, IF);
+  grow(c, -1);
+  compile_expr(c, next(&args), tail);
+  int done = emit_jump(c, JMP);
+  grow(c, -1);
+  patch_jump(c, otherwise);
+  compile_expr(c, next(&args), tail);
+  patch_jump(c, done);
+}
+
+static void compile_while(compiler_t *c, value_t args) {
+  emit_lit(c, Undefined);
+  int start = c->code->len;
+  compile_expr(c, next(&args), false);
+  int done = emit_jump(c, IF);
+  grow(c, -1);
+  emit(c, DRP);
+  grow(c, -1);
+  compile_block(c, args, false);
+  emit_loop(c, start);
+  patch_jump(c, done);
+}
+
+// The lambda's own body is compiled now, building the closure copies the
+// captured variables that are locals here and leaves the rest unbound.
+static void compile_lambda(compiler_t *c, value_t fn) {
+  c->code->impure = true;
+  value_t names = free_names(fn);
+  int count = list_length(names);
+  if (count > UINT8_MAX) {
+    c->failed = true;
+    return;
+  }
+  code_compile(fn, names);
+  emit(c, CLO);
+  emit16(c, add_const(c, fn));
+  emit(c, (uint8_t)count);
+  while (names.type == PairType) {
+    value_t name = next(&names);
+    int slot = find_local(c, name);
+    if (slot == UINT8_MAX) c->failed = true;
+    emit16(c, add_const(c, name));
+    emit(c, slot < 0 ? UINT8_MAX : (uint8_t)slot);
+  }
+  grow(c, 1);
+}
+
+// Builtins with an opcode of their own when called with this many
+// arguments.  Builtin symbols can't be rebound so this is decided here.
+static const struct {
+  const char *name;
+  opcode_t op;
+  int argc;
+} inlined[] = {
+  {"+", ADD, 2},
+  {"-", SUB, 2},
+  {"<", LT, 2},
+  {"=", EQ, 2},
+  {"car", CAR, 1},
+  {"cdr", CDR, 1},
+};
+
+static bool compile_inlined(compiler_t *c, value_t head, value_t args) {
+  if (head.type != SymbolType || head.data < 0) return false;
+  int argc = 0;
+  for (value_t arg = args; arg.type == PairType; arg = cdr(arg)) argc++;
+  for (size_t i = 0; i < sizeof(inlined) / sizeof(*inlined); i++) {
+    if (inlined[i].argc != argc ||
+        head.data != symbols_set(inlined[i].name, 0)) continue;
+    while (args.type == PairType) {
+      compile_expr(c, next(&args), false);
+    }
+    emit(c, inlined[i].op);
+    grow(c, 1 - argc);
+    return true;
+  }
+  return false;
+}
+
+static void add_inlined(compiler_t *c, value_t name) {
+  code_t *code = c->code;
+  for (int i = 0; i < code->num_inlined; i++) {
+    if (eq(code->inlined[i], name)) return;
+  }
+  code->inlined = realloc(code->inlined,
+    (size_t)(code->num_inlined + 1) * sizeof(value_t));
+  code->inlined[code->num_inlined++] = name;
+}
+
+// Calls to small compiled global functions are replaced by their body,
+// its params and locals getting slots of their own that hide the
+// caller's while it's compiled, and are hidden themselves after.  Inlined
+// bodies don't inline again so recursion stops there.
+// code_invalidate recompiles the caller when the global changes.
+static bool compile_inline(compiler_t *c, value_t head, value_t args, bool tail) {
+  if (c->inlining || head.type != SymbolType || head.data >= 0 ||
+      find_local(c, head) >= 0) return false;
+  value_t fn = table_get(globals, head);
+  if (eq(fn, c->code->fn) || is_closure(fn)) return false;
+  code_t *callee = code_find(fn);
+  if (!callee || callee->len > INLINE_MAX ||
+      c->code->num_locals + callee->num_locals > UINT8_MAX) return false;
+  add_inlined(c, head);
+  int argc = 0;
+  while (args.type == PairType) {
+    compile_expr(c, next(&args), false);
+    argc++;
+  }
+  int scope = c->scope;
+  c->scope = c->code->num_locals;
+  c->inlining = true;
+  value_t params = car(fn);
+  while (params.type == PairType) {
+    add_local(c, next(&params));
+  }
+  int num_params = c->code->num_locals - c->scope;
+  value_t body = cdr(fn);
+  while (body.type == PairType) {
+    scan_sets(c, next(&body));
+  }
+  // Locals start unset on every pass, like in a fresh frame.
+  for (int slot = c->scope + num_params; slot < c->code->num_locals; slot++) {
+    emit_lit(c, EmptySlot);
+    emit(c, SET);
+    emit(c, (uint8_t)slot);
+    emit(c, DRP);
+    grow(c, -1);
+  }
+  for (; argc > num_params; argc--) {
+    emit(c, DRP);
+    grow(c, -1);
+  }
+  for (; argc < num_params; argc++) {
+    emit_lit(c, Undefined);
+  }
+  for (int slot = c->scope + num_params - 1; slot >= c->scope; slot--) {
+    emit(c, SET);
+    emit(c, (uint8_t)slot);
+    emit(c, DRP);
+    grow(c, -1);
+  }
+  compile_block(c, cdr(fn), tail);
+  for (int slot = c->scope; slot < c->code->num_locals; slot++) {
+    c->hidden[slot] = true;
+  }
+  c->scope = scope;
+  c->inlining = false;
+  return true;
+}
+
+static void compile_call(compiler_t *c, value_t form, bool tail) {
+  pair_t pair = get_pair(form);
+  if (compile_inlined(c, pair.left, pair.right)) return;
+  if (compile_inline(c, pair.left, pair.right, tail)) return;
+  if (!is_pure(pair.left)) c->code->impure = true;
+  int argc = -1;
+  while (form.type == PairType) {
+    compile_expr(c, next(&form), false);
+    argc++;
+  }
+  if (argc > UINT8_MAX) {
+    c->failed = true;
+    return;
+  }
+  emit(c, tail ? TCL : CAL);
+  emit(c, (uint8_t)argc);
+  grow(c, -argc);
+}
+
+// Calls in tail position (the value of the function) compile to TCL.
+static void compile_expr(compiler_t *c, value_t form, bool tail) {
+  if (c->failed) return;
+  // User symbols are variable references, everything else but pairs is
+  // a literal.
+  if (form.type == SymbolType && form.data < 0) {
+    compile_ref(c, form);
+    return;
+  }
+  if (form.type != PairType) {
+    emit_lit(c, form);
+    return;
+  }
+  pair_t pair = get_pair(form);
+  if (!is_keyword(pair.left)) {
+    compile_call(c, form, tail);
+    return;
+  }
+  if (eq(pair.left, quoteSym)) emit_lit(c, pair.right);
+  else if (eq(pair.left, doSym)) compile_block(c, pair.right, tail);
+  else if (eq(pair.left, getSym)) compile_get(c, pair.right);
+  else if (eq(pair.left, setSym)) compile_set(c, pair.right);
+  else if (eq(pair.left, ifSym)) compile_if(c, pair.right, tail);
+  else if (eq(pair.left, whileSym)) compile_while(c, pair.right);
+  else if (eq(pair.left, lambdaSym)) compile_lambda(c, pair.right);
+  else c->failed = true;
+}
+
+static void code_free(code_t *code) {
+#ifdef JIT
+  jit_free(code);
+#endif
+  free(code->ops);
+  free(code->consts);
+  free(code->names);
+  free(code->inlined);
+  free(code);
+}
+
+// FNV-1a over every cell of a list once, shared and cyclic ones included.
+static uint64_t hash_cells(value_t node, uint64_t hash) {
+  while (node.type == PairType && !visit(node)) {
+    pair_t pair = get_pair(node);
+    hash = (hash ^ pair.left.raw) * 1099511628211u;
+    hash = (hash ^ pair.right.raw) * 1099511628211u;
+    hash = hash_cells(pair.left, hash);
+    node = pair.right;
+  }
+  return hash;
+}
+
+// Hash of the function list and of the functions inlined into it, so
+// an edit to any cell of either shows.
+static uint64_t code_hash(code_t *code) {
+  uint64_t hash = hash_cells(code->fn, 14695981039346656037u);
+  for (int i = 0; i < code->num_inlined; i++) {
+    hash = hash_cells(table_get(globals, code->inlined[i]), hash);
+  }
+  visits_clear();
+  return hash;
+}
+
+// Is the code still that of its function list?  Lists are only hashed
+// again after a write to a cell of some compiled list.
+static bool code_fresh(code_t *code) {
+  if (get_pair(code->fn).raw != code->head.raw) return false;
+  if (code->edits == code_edits) return true;
+  code->edits = code_edits;
+  return code_hash(code) == code->hash;
+}
+
+static code_t *code_build(value_t fn, value_t captures);
+
+// Find the entry for fn, compiled or not.  If the list, or one it inlined,
+// was changed or its cell reused since it was compiled, the entry is
+// dropped and the list compiled again as it is now.
+static code_t *code_entry(value_t fn) {
+  if (fn.type != PairType) return 0;
+  code_t **link = &codes[fn.data % CODE_BUCKETS];
+  while (*link) {
+    code_t *code = *link;
+    if (eq(code->fn, fn)) {
+      if (code_fresh(code)) return code;
+      *link = code->next;
+      code->next = retired;
+      retired = code;
+      return code_build(fn,
+        list_of(code->num_captures, code->names + code->num_params));
+    }
+    link = &code->next;
+  }
+  return 0;
+}
+
+// Compile fn and add its entry, len 0 if it can't be compiled.
+static code_t *code_build(value_t fn, value_t captures) {
+  compiler_t c = { .code = calloc(1, sizeof(code_t)) };
+  code_t *code = c.code;
+  code->fn = fn;
+  code->head = get_pair(fn);
+  value_t params = code->head.left;
+  while (params.type == PairType) {
+    value_t param = next(&params);
+    if (param.type != SymbolType || param.data >= 0 ||
+        find_local(&c, param) >= 0) {
+      c.failed = true;
+      break;
+    }
+    add_local(&c, param);
+  }
+  if (!isNil(params)) c.failed = true;
+  code->num_params = code->num_locals;
+  while (captures.type == PairType) {
+    add_local(&c, next(&captures));
+  }
+  code->num_captures = code->num_locals - code->num_params;
+  value_t body = code->head.right;
+  while (body.type == PairType) {
+    scan_sets(&c, next(&body));
+  }
+  compile_block(&c, code->head.right, true);
+  emit(&c, RET);
+  if (c.failed) {
+    free(code->ops);
+    free(code->consts);
+    free(code->names);
+    free(code->inlined);
+    *code = (code_t){ .fn = fn, .head = code->head };
+  }
+  code_cells(fn);
+  code->hash = code_hash(code);
+  code->edits = code_edits;
+  code_t **bucket = &codes[fn.data % CODE_BUCKETS];
+  code->next = *bucket;
+  *bucket = code;
+  return code;
+}
+
+// Compile a function list `(params body...)` and remember the result so
+// apply can find it.  captures lists the variables a lambda closes over,
+// they get the slots after the params.  Returns 0 if the function can't
+// be compiled, which is remembered too so lambdas aren't retried.
+API code_t *code_compile(value_t fn, value_t captures) {
+  if (fn.type != PairType) return 0;
+  code_t *code = code_entry(fn);
+  if (!code) code = code_build(fn, captures);
+  return code->len ? code : 0;
+}
+
+// Find the compiled form of a function or closure.
+API code_t *code_find(value_t fn) {
+  code_t *code = code_entry(fn_list(fn));
+  return code && code->len ? code : 0;
+}
+
+// Recompile every function that inlined the global name, it's been
+// redefined.
+API void code_invalidate(value_t name) {
+  code_t *stale = 0;
+  for (int i = 0; i < CODE_BUCKETS; i++) {
+    code_t **link = &codes[i];
+    while (*link) {
+      code_t *code = *link;
+      bool inlined = false;
+      for (int j = 0; j < code->num_inlined; j++) {
+        if (eq(code->inlined[j], name)) inlined = true;
+      }
+      if (inlined) {
+        *link = code->next;
+        code->next = stale;
+        stale = code;
+      }
+      else {
+        link = &code->next;
+      }
+    }
+  }
+  // The old code may still be running, retire it rather than free it.
+  while (stale) {
+    code_t *code = stale;
+    stale = code->next;
+    code->next = retired;
+    retired = code;
+    code_compile(code->fn,
+      list_of(code->num_captures, code->names + code->num_params));
+  }
+}
+
+// Forget compiled code whose function list has been garbage collected.
+// Must not be called while the vm is running.
+API void code_sweep() {
+  while (retired) {
+    code_t *code = retired;
+    retired = code->next;
+    code_free(code);
+  }
+  for (int i = 0; i < CODE_BUCKETS; i++) {
+    code_t **link = &codes[i];
+    while (*link) {
+      code_t *code = *link;
+      if (!is_live(code->fn)) {
+        *link = code->next;
+        code_free(code);
+      }
+      else {
+        link = &code->next;
+      }
+    }
+  }
+}
+
+#endif
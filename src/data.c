@@ -3,11 +3,61 @@
 
 #include "types.h"
 #include <stdlib.h> // for realloc
+#include <setjmp.h> // for setjmp
+#include <string.h> // for memcpy
 
 static pair_t *pairs;
+static uint8_t *quick; // quick_t of each cell, see __eval
 static int next_pair;
 static int num_pairs;
 
+// One bit per cell for walks that need to know where they've been, like
+// dump.  Only the words between visited_low and visited_high are dirty.
+static uint32_t *visited;
+static int visited_low = -1;
+static int visited_high = -1;
+
+// One bit per cell of a compiled function list.  Writing to one counts in
+// code_edits, compiled code checks its list again when that has moved.
+static uint32_t *in_code;
+API uint32_t code_edits;
+
+// Regions: everything allocated between region_begin and region_end is
+// tagged with the region's number.  At the end, cells reachable from heap
+// cells written during the region are promoted to the heap (region 0) and
+// the whole region is then freed at once by flagging its number as
+// reclaimed.  A full collection clears the flags again.
+static uint8_t *regions;     // region each cell was allocated in
+static bool reclaimed[256];  // regions whose remaining cells are free
+static uint8_t region;       // current region, 0 outside of one
+static uint8_t next_region = 1;
+static int region_low;       // lowest slot allocated in the region
+static int region_cells;     // cells allocated in the region
+static int *remembered;      // heap cells pointed into the region
+static int num_remembered;
+static int remembered_len;
+static int heap_cells;       // cells kept by the last collection or promoted
+static int heap_limit = GC_MIN_CELLS;
+API bool gc_log = true; // dump every cell a collection frees
+
+// Variables outside the heap that collections and regions keep alive on
+// top of the root they're given, like a parser halfway through a form.
+static value_t *kept[8];
+static int num_kept;
+
+// A region that outgrows heap_limit is collected from cons, in the middle
+// of whatever is running.  What that has in hand is found by scanning the
+// C stack from gc_stack_base, and the vm's stack, for anything that looks
+// like a pair.  Code holding values where neither can see them, like a
+// malloc'd array, pauses it.
+static const void *gc_stack_base;
+static int gc_paused;
+static int gc_freed; // by collections during the current region
+
+static bool is_dead(int slot) {
+  return isFree(pairs[slot]) || reclaimed[regions[slot]];
+}
+
 
 API value_t copy(value_t value) {
   if (value.type != PairType) return value;
@@ -35,32 +85,162 @@ API value_t free_list(value_t node) {
 }
 
 static void mark(value_t node) {
-  if (node.type != PairType || pairs[node.data].raw == Free.raw || pairs[node.data].left.gc) return;
-  pairs[node.data].left.gc = 1;
-  mark(pairs[node.data].left);
-  mark(pairs[node.data].right);
+  while (node.type == PairType && !is_dead(node.data) &&
+      !pairs[node.data].left.gc) {
+    pairs[node.data].left.gc = 1;
+    mark(pairs[node.data].left);
+    node = pairs[node.data].right;
+  }
 }
 
-API int collectgarbage(value_t root) {
-  mark(root);
+// Free every cell that isn't marked, unmarking the rest, which all end up
+// in the heap.  Returns the cells freed.
+static int sweep() {
   int num_freed = 0;
+  heap_cells = 0;
   for (int i = num_pairs - 1; i >= 0; i--) {
     if (pairs[i].left.gc) {
       pairs[i].left.gc = 0;
+      regions[i] = 0;
+      heap_cells++;
       continue;
     }
     if (pairs[i].raw == Free.raw) {
       continue;
     }
-    print("collected: ");
-    dump_pair(pairs[i]);
+    // Already freed with its region, just make it plainly free.
+    if (reclaimed[regions[i]]) {
+      pairs[i].raw = Free.raw;
+      regions[i] = 0;
+      next_pair = i;
+      continue;
+    }
+    // Garbage of the current region isn't news, region_end frees it too.
+    if (gc_log && !regions[i]) {
+      print("collected: ");
+      dump_pair(pairs[i]);
+    }
     pairs[i].raw = Free.raw;
     next_pair = i;
     num_freed++;
   }
+  for (int i = 0; i < 256; i++) reclaimed[i] = false;
+  heap_limit = heap_cells * 2 > GC_MIN_CELLS ? heap_cells * 2 : GC_MIN_CELLS;
   return num_freed;
 }
 
+API int collectgarbage(value_t root) {
+  mark(root);
+  for (int i = 0; i < num_kept; i++) mark(*kept[i]);
+  int num_freed = sweep();
+  next_region = 1;
+  code_sweep();
+  return num_freed;
+}
+
+// Mark the words between from and to that could be pairs.
+static void mark_words(const void *from, const void *to) {
+  const char *at = from, *end = to;
+  if (at > end) {
+    at = to;
+    end = from;
+  }
+  for (; at + sizeof(value_t) <= end; at += sizeof(value_t)) {
+    value_t val;
+    memcpy(&val, at, sizeof(val));
+    if (val.type == PairType && val.data >= 0 && val.data < num_pairs) {
+      mark(val);
+    }
+  }
+}
+
+API void gc_stack(const void *base) {
+  gc_stack_base = base;
+}
+
+// Collect from cons, with left and right about to go into a new cell.
+// The region's surviving cells join the heap, the rest is freed now
+// rather than at region_end.  Compiled code isn't swept, it may be
+// running.
+static void collect_now(value_t left, value_t right) {
+  jmp_buf registers;
+  setjmp(registers);
+  mark_words(&registers, (const char *)&registers + sizeof(registers));
+  mark_words(&registers, gc_stack_base);
+  vm_roots(mark);
+  mark(left);
+  mark(right);
+  mark(globals);
+  for (int i = 0; i < num_kept; i++) mark(*kept[i]);
+  gc_freed += sweep();
+  num_remembered = 0;
+  region_cells = 0;
+}
+
+// Nests, collections from cons resume once every pause has ended.
+API void gc_pause(bool pause) {
+  gc_paused += pause ? 1 : -1;
+}
+
+API void region_begin() {
+  region = next_region;
+  region_low = num_pairs;
+  region_cells = 0;
+  gc_freed = 0;
+}
+
+API void gc_keep(value_t *root) {
+  if (num_kept < (int)(sizeof(kept) / sizeof(*kept))) kept[num_kept++] = root;
+}
+
+// Move region cells reachable from node to the heap.
+static int promote(value_t node) {
+  int count = 0;
+  while (node.type == PairType && regions[node.data] == region) {
+    regions[node.data] = 0;
+    count++;
+    count += promote(pairs[node.data].left);
+    node = pairs[node.data].right;
+  }
+  return count;
+}
+
+// End the region, keeping what root or the heap refers to and freeing the
+// rest.  Runs a full collection from root once the heap has doubled since
+// the last one or the region numbers run out.  Returns the cells freed.
+API int region_end(value_t root) {
+  int promoted = promote(root);
+  for (int i = 0; i < num_kept; i++) promoted += promote(*kept[i]);
+  for (int i = 0; i < num_remembered; i++) {
+    pair_t pair = pairs[remembered[i]];
+    promoted += promote(pair.left) + promote(pair.right);
+  }
+  num_remembered = 0;
+  reclaimed[region] = true;
+  if (region_low < next_pair) next_pair = region_low;
+  heap_cells += promoted;
+  region = 0;
+  int freed = region_cells - promoted + gc_freed;
+  if (++next_region == 0 || heap_cells > heap_limit) {
+    freed += collectgarbage(root);
+  }
+  else {
+    code_sweep();
+  }
+  return freed;
+}
+
+// Remember heap cells that are made to point into the current region.
+static void write_barrier(value_t var, value_t val) {
+  if (!region || val.type != PairType || regions[val.data] != region ||
+      regions[var.data] == region) return;
+  if (num_remembered == remembered_len) {
+    remembered_len += PAIRS_BLOCK_SIZE;
+    remembered = realloc(remembered, (size_t)remembered_len * sizeof(int));
+  }
+  remembered[num_remembered++] = var.data;
+}
+
 API value_t Bool(bool val) {
   return val ? True : False;
 }
@@ -87,13 +267,11 @@ API value_t SymbolRange(const char* sym, const char* end) {
 }
 
 static int find_pair_slot() {
-  while (next_pair < num_pairs && !isFree(pairs[next_pair])) {
+  while (next_pair < num_pairs && !is_dead(next_pair)) {
     // TODO: we should probably also loop around before giving up.
     next_pair++;
   }
 
-  // TODO: we should probably GC at this point.
-
   // Resize pair backing buffer if need-be
   int needed = next_pair + 1;
   if (needed > num_pairs) {
@@ -101,8 +279,15 @@ static int find_pair_slot() {
     // and batch allocations.
     int new_len = needed + (PAIRS_BLOCK_SIZE - needed % PAIRS_BLOCK_SIZE);
     pairs = realloc(pairs, (size_t)new_len * sizeof(pair_t));
+    quick = realloc(quick, (size_t)new_len);
+    regions = realloc(regions, (size_t)new_len);
+    int words = (num_pairs + 31) / 32, new_words = (new_len + 31) / 32;
+    visited = realloc(visited, (size_t)new_words * sizeof(uint32_t));
+    in_code = realloc(in_code, (size_t)new_words * sizeof(uint32_t));
+    for (int j = words; j < new_words; j++) visited[j] = in_code[j] = 0;
     for (int j = num_pairs; j < new_len; j++) {
       pairs[j] = Free;
+      regions[j] = 0;
     }
     num_pairs = new_len;
   }
@@ -111,13 +296,22 @@ static int find_pair_slot() {
 }
 
 API value_t cons(value_t left, value_t right) {
-  // For now the GC bits are set to zero.
-  // When we write the GC later this may change.
+  if (region && gc_stack_base && !gc_paused &&
+      heap_cells + region_cells > heap_limit) {
+    collect_now(left, right);
+  }
   int slot = find_pair_slot();
   pairs[slot] = (pair_t){
     .left = left,
     .right = right
   };
+  quick[slot] = Q_NONE;
+  in_code[slot / 32] &= ~(1u << (slot % 32));
+  regions[slot] = region;
+  if (region) {
+    region_cells++;
+    if (slot < region_low) region_low = slot;
+  }
   return (value_t){
     .type = PairType,
     .data = slot
@@ -132,18 +326,45 @@ API value_t cdr(value_t var) {
   return var.type == PairType ? pairs[var.data].right : Undefined;
 }
 
+static bool is_code(int slot) {
+  return in_code[slot / 32] & (1u << (slot % 32));
+}
+
+// Flag the cells of a function list that is being compiled.
+API void code_cells(value_t node) {
+  while (node.type == PairType && !is_code(node.data)) {
+    in_code[node.data / 32] |= 1u << (node.data % 32);
+    code_cells(pairs[node.data].left);
+    node = pairs[node.data].right;
+  }
+}
+
 API bool set_car(value_t var, value_t val) {
   if (var.type != PairType) return false;
+  write_barrier(var, val);
+  if (is_code(var.data)) code_edits++;
   pairs[var.data].left = val;
+  quick[var.data] = Q_NONE;
   return true;
 }
 
 API bool set_cdr(value_t var, value_t val) {
   if (var.type != PairType) return false;
+  write_barrier(var, val);
+  if (is_code(var.data)) code_edits++;
   pairs[var.data].right = val;
+  quick[var.data] = Q_NONE;
   return true;
 }
 
+API uint8_t get_quick(value_t slot) {
+  return slot.type == PairType ? quick[slot.data] : Q_NONE;
+}
+
+API void set_quick(value_t slot, uint8_t kind) {
+  if (slot.type == PairType) quick[slot.data] = kind;
+}
+
 API pair_t get_pair(value_t slot) {
   return (slot.type == PairType) ? pairs[slot.data] : (pair_t){
     .right = TypeError,
@@ -170,6 +391,28 @@ API bool isTruthy(value_t value) {
   return value.type != AtomType || value.data > 0;
 }
 
+// Is the cell in use, as opposed to free or freed with its region?
+API bool is_live(value_t slot) {
+  return slot.type == PairType && slot.data < num_pairs && !is_dead(slot.data);
+}
+
+// Flag the cell as visited, true if it already was.
+API bool visit(value_t slot) {
+  if (slot.type != PairType) return false;
+  int word = slot.data / 32;
+  uint32_t bit = 1u << (slot.data % 32);
+  if (visited[word] & bit) return true;
+  visited[word] |= bit;
+  if (visited_low < 0 || word < visited_low) visited_low = word;
+  if (word > visited_high) visited_high = word;
+  return false;
+}
+
+API void visits_clear() {
+  for (int i = visited_low; i >= 0 && i <= visited_high; i++) visited[i] = 0;
+  visited_low = visited_high = -1;
+}
+
 API bool isFree(pair_t pair) {
   return pair.raw == Free.raw;
 }
@@ -2,6 +2,7 @@
 #define DUMP_C
 
 #include "types.h"
+#include <stdlib.h> // for realloc
 
 #ifndef THEME
   #define COFF ""
@@ -55,16 +56,44 @@
   #define CSTRING "\x1b[1;36m"
 #endif
 
-static value_t seen;
-
+// Every pair dumped so far is flagged with visit(), one that comes up
+// again is shared or part of a cycle and is shown as (...).  The flags are
+// cleared once the whole value is done.
 static void unsee() {
-  seen = free_list(seen);
+  visits_clear();
 }
 
-API void _dump(value_t val) {
+// Lists are printed without recursing, each open one is a frame on a
+// stack that grows on the heap, so no nesting can overflow the C stack.
+typedef struct {
+  value_t node;       // rest of the list, the pair holding the next item
+  const char *closer;
+  int count;          // items printed so far
+} dump_frame_t;
+
+static dump_frame_t *frames;
+static int num_frames;
+static int frames_len;
+
+// How deep and how many items per list are printed before eliding the
+// rest with ..., 0 for no limit.
+static dump_limits_t limits = {DUMP_DEPTH, DUMP_LENGTH};
+
+static void frame_push(value_t node, const char *closer) {
+  if (num_frames == frames_len) {
+    frames_len = frames_len ? frames_len * 2 : 16;
+    frames = realloc(frames, (size_t)frames_len * sizeof(dump_frame_t));
+  }
+  frames[num_frames++] = (dump_frame_t){ .node = node, .closer = closer };
+}
+
+static void dump_atom(value_t val) {
   switch (val.type) {
     case AtomType:
       switch (val.data) {
+        case -7: print(CBUILTIN"<closure>"); return;
+        case -6: print(CBUILTIN"<stream>"); return;
+        case -5: print(CERROR"range-error"); return;
         case -4: print(CERROR"type-error"); return;
         case -1: print(CNIL"nil"); return;
         case 1: print(CBOOL"true"); return;
@@ -81,106 +110,130 @@ API void _dump(value_t val) {
       else print(CBUILTIN);
       print(symbols_get_name(val.data));
       return;
-    case PairType: {
-      value_t node = seen;
-      while (node.type == PairType) {
-        pair_t pair = get_pair(node);
-        if (eq(pair.left, val)) {
-          print(CPAREN"("CSEP"..."CPAREN")");
+    case PairType:
+      return;
+  }
+}
+
+// Print an atom, or the start of a list and push a frame for the rest.
+static void dump_open(value_t val) {
+  if (val.type != PairType) {
+    dump_atom(val);
+    return;
+  }
+  if (visit(val)) {
+    print(CPAREN"("CSEP"..."CPAREN")");
+    return;
+  }
+  if (limits.depth && num_frames >= limits.depth) {
+    print(CSEP"...");
+    return;
+  }
+  pair_t pair = get_pair(val);
+  const char *opener = "(", *closer = ")";
+  if (eq(pair.left, quoteSym)) {
+    if (pair.right.type != PairType) {
+      if (pair.right.type == SymbolType && pair.right.data < 0) {
+        const char* data = symbols_get_name(pair.right.data);
+        const char* p = data;
+        bool whole = true;
+        while (whole && *p) whole = *p++ != ' ';
+        if (!whole) {
+          print(CSTRING"\"");
+          print(data);
+          print("\"");
           return;
         }
-        node = pair.right;
       }
-      seen = cons(val, seen);
-      pair_t pair = get_pair(val);
-      const char *opener, *closer;
-      if (eq(pair.left, quoteSym)) {
-        if (pair.right.type != PairType) {
-          if (pair.right.type == SymbolType && pair.right.data < 0) {
-            const char* data = symbols_get_name(pair.right.data);
-            const char* p = data;
-            bool whole = true;
-            while (whole && *p) whole = *p++ != ' ';
-            if (!whole) {
-              print(CSTRING"\"");
-              print(data);
-              print("\"");
-              return;
-            }
-          }
-          print(CPAREN"'");
-          _dump(pair.right);
-          return;
+      print(CPAREN"'");
+      dump_atom(pair.right);
+      return;
+    }
+    opener = "'(";
+    val = pair.right;
+  }
+  else if (eq(pair.left, listSym) && pair.right.type == PairType) {
+    opener = "[";
+    closer = "]";
+    val = pair.right;
+  }
+  print(CPAREN);
+  print(opener);
+  frame_push(val, closer);
+}
+
+API void _dump(value_t val) {
+  int base = num_frames;
+  dump_open(val);
+  while (num_frames > base) {
+    dump_frame_t *frame = &frames[num_frames - 1];
+    value_t node = frame->node;
+    if (node.type == PairType) {
+      if (frame->count) {
+        if (visit(node)) {
+          print(CSEP" . "CPAREN"("CSEP"..."CPAREN")");
+          frame->node = Nil;
+          continue;
         }
-        opener = "'(";
-        closer = ")";
-        val = pair.right;
-        pair = get_pair(val);
+        print_char(' ');
       }
-      else if (eq(pair.left, listSym) && pair.right.type == PairType) {
-        opener = "[";
-        closer = "]";
-        val = pair.right;
-        pair = get_pair(val);
-      }
-      else {
-        opener = "(";
-        closer = ")";
-      }
-      print(CPAREN);
-      print(opener);
-      if (isNil(pair.right)) {
-        _dump(pair.left);
-      }
-      else if (pair.right.type == PairType) {
-        _dump(pair.left);
-        while (pair.right.type == PairType) {
-          print_char(' ');
-          pair = get_pair(pair.right);
-          _dump(pair.left);
-        }
-        if (!isNil(pair.right)) {
-          print(CSEP" . ");
-          _dump(pair.right);
-        }
-      } else {
-        _dump(pair.left);
-        print(CSEP" . ");
-        _dump(pair.right);
+      if (limits.length && frame->count >= limits.length) {
+        print(CSEP"...");
+        frame->node = Nil;
+        continue;
       }
+      pair_t pair = get_pair(node);
+      frame->node = pair.right;
+      frame->count++;
+      // May push a frame, invalidating the pointer.
+      dump_open(pair.left);
+    }
+    else if (!isNil(node)) {
+      frame->node = Nil;
+      print(CSEP" . ");
+      dump_atom(node);
+    }
+    else {
       print(CPAREN);
-      print(closer);
-      return;
+      print(frame->closer);
+      num_frames--;
     }
   }
 }
 
+API void dump_limited(value_t val, dump_limits_t with) {
+  dump_limits_t saved = limits;
+  limits = with;
+  dump_line(val);
+  limits = saved;
+}
+
 API void dump(value_t val) {
-  unsee();
   _dump(val);
+  unsee();
   print(COFF"\n");
 }
 
 API void dump_pair(pair_t pair) {
-  unsee();
   print(CPAREN"(");
   _dump(pair.left);
   print(CSEP" . ");
   _dump(pair.right);
+  unsee();
   print(CPAREN")"COFF"\n");
 }
 
 API void dump_line(value_t val) {
   if (val.type == PairType) {
     pair_t pair = get_pair(val);
-    unsee();
     _dump(pair.left);
+    unsee();
     val = pair.right;
     while (val.type == PairType) {
       print_char(' ');
       pair_t pair = get_pair(val);
-      unsee();
       _dump(pair.left);
+      unsee();
       val = pair.right;
     }
   }
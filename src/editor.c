@@ -5,11 +5,12 @@
 #include <stdlib.h> // for exit
 #include <signal.h> // for SIGINT and signal
 #include <unistd.h> // for read
+#include <errno.h> // for EINTR
 
 typedef struct line_s {
   int x;
   int length;
-  char line[MAX_LINE_LENGTH];
+  char line[MAX_LINE_LENGTH + 1]; // room to shift into and terminate
 } line_t;
 
 static const char* prompt;
@@ -24,26 +25,56 @@ static char csi_args[3];
 static line_t current, memory;
 static struct termios old_tio, new_tio;
 
+// What the terminal shows of the line, so a redraw only sends what changed.
+static line_t shown;
+static bool stale = true; // not known, redraw it all
+
 static bool moveLeft(int n) {
-  if (n == 0) return true;
   current.x -= n;
-  print("\33[");
-  print_int(n);
-  print_char('D');
-  print_flush();
   return true;
 }
 
 static bool moveRight(int n) {
-  if (n == 0) return true;
   current.x += n;
-  print("\33[");
-  print_int(n);
-  print_char('C');
-  print_flush();
   return true;
 }
 
+static void cursor_move(int from, int to) {
+  if (to == from) return;
+  print("\33[");
+  print_int(to < from ? from - to : to - from);
+  print_char(to < from ? 'D' : 'C');
+}
+
+// Bring the terminal up to date with current in as few bytes as possible:
+// from the first column that differs, rewrite the rest of the line.
+static void render() {
+  if (stale) {
+    print("\r\33[K");
+    print((const char*)prompt);
+    print_string(current.line, current.length);
+    cursor_move(current.length, current.x);
+    stale = false;
+  }
+  else {
+    int same = 0;
+    while (same < current.length && same < shown.length &&
+           current.line[same] == shown.line[same]) {
+      same++;
+    }
+    if (same < current.length || same < shown.length) {
+      cursor_move(shown.x, same);
+      print_string(current.line + same, (size_t)(current.length - same));
+      if (shown.length > current.length) print("\33[K");
+      cursor_move(current.length, current.x);
+    }
+    else {
+      cursor_move(shown.x, current.x);
+    }
+  }
+  shown = current;
+}
+
 static bool handleChar(char c) {
   if (c == 0) { goto refresh; }
   switch (mode) {
@@ -86,6 +117,7 @@ static bool handleChar(char c) {
       if (current.length) {
         current.line[current.length] = 0;
         onLine(current.line);
+        stale = true;
       }
       memory.x = 0;
       memory.length = 0;
@@ -93,7 +125,6 @@ static bool handleChar(char c) {
     }
     if (c == 12) { // Control+L clear screen
       print("\33[2J\33[H");
-      print_flush();
       goto refresh;
     }
     // Uncomment to see unhandled codes
@@ -174,6 +205,7 @@ static bool handleChar(char c) {
           print_int(csi_args[i]);
         }
         print_char('\n');
+        stale = true;
         break;
       }
     }
@@ -182,7 +214,6 @@ static bool handleChar(char c) {
 
   insert: {
     int i = current.length;
-    int t = current.length + 1;
     if (i > MAX_LINE_LENGTH) {
       i = MAX_LINE_LENGTH;
     }
@@ -197,14 +228,8 @@ static bool handleChar(char c) {
     if (current.length < MAX_LINE_LENGTH) {
       current.length++;
     }
-    if (current.x == t) {
-      print_char(c);
-      print_flush();
-      return true;
-    }
-
   }
-  goto refresh;
+  return true;
 
   swap: {
     line_t temp = current;
@@ -224,15 +249,7 @@ static bool handleChar(char c) {
   goto refresh;
 
   refresh:
-    print("\r\33[K");
-    print((const char*)prompt);
-    print_string(current.line, current.length);
-    if (current.x < current.length) {
-      print("\33[");
-      print_int((current.length - current.x));
-      print_char('D');
-    }
-    print_flush();
+    stale = true;
     return true;
 }
 
@@ -253,24 +270,36 @@ static void editor_start() {
 	new_tio.c_lflag &= (unsigned)(~ICANON & ~ECHO);
 	tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
   signal(SIGINT, onInt);
-  handleChar(0);
+  render();
 }
 
 static void editor_stop() {
   finished = true;
   print_char('\n');
+  print_wait();
   /* restore the former settings */
 	tcsetattr(STDIN_FILENO, TCSANOW, &old_tio);
 }
 
+// Handle everything that's come in, a whole paste at once, then redraw
+// the line in a single write.  Stops at the end of input.
 API bool editor_step() {
   if (finished) return false;
   if (!started) editor_start();
-  char c;
-  read(0, &c, 1);
-  if(handleChar(c)) return true;
-  editor_stop();
-  return false;
+  // Everything printed so far is on screen before blocking, even when a
+  // writer thread has it queued.
+  print_wait();
+  char input[EDITOR_READ_LENGTH];
+  ssize_t got = read(0, input, sizeof(input));
+  if (got < 0 && errno == EINTR) return true;
+  bool going = got > 0;
+  for (ssize_t i = 0; going && i < got; i++) going = handleChar(input[i]);
+  if (!going) {
+    editor_stop();
+    return false;
+  }
+  render();
+  return true;
 }
 
 static void onInt(int sig) {
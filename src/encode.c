@@ -0,0 +1,362 @@
+#ifndef ENCODE_C
+#define ENCODE_C
+
+#include "types.h"
+#include <stdlib.h> // for realloc and free
+
+// Binary form of a value, for the wire and for keeping state around:
+//
+//   version, symbol count, (length, name)..., value
+//
+// Numbers are varints, 7 bits per byte with the high bit set on all but
+// the last, signed ones zigzagged first so small negatives stay short.
+// Every symbol is named once up front and then referred to by its place in
+// that table, builtins too, so the message doesn't depend on the build.
+// A value is a tag byte and its payload:
+//
+//   ENC_NIL
+//   ENC_ATOM data            other atoms like true or undefined
+//   ENC_INT data
+//   ENC_SYM index            into the symbol table
+//   ENC_LIST count item... tail
+//   ENC_REF id               a pair already sent
+//
+// A list is a run of count pairs down the right side, each getting the
+// next id, and ends with whatever the last one's right side holds.  A pair
+// that comes up again is sent as a reference to its id, so shared and
+// cyclic structure survive the trip.  Neither side recurses.
+
+#define ENC_VERSION 1
+
+enum {
+  ENC_NIL,
+  ENC_ATOM,
+  ENC_INT,
+  ENC_SYM,
+  ENC_LIST,
+  ENC_REF,
+};
+
+// Open addressed map from a value to the number it was given, the number
+// stored plus one so zero means empty.
+typedef struct {
+  uint32_t *keys;
+  int *ids;
+  int len;  // power of two
+  int count;
+} enc_ids_t;
+
+static int ids_find(enc_ids_t *map, value_t val) {
+  if (!map->len) return -1;
+  uint32_t mask = (uint32_t)map->len - 1;
+  for (uint32_t i = (val.raw * 2654435761u) & mask;; i = (i + 1) & mask) {
+    if (!map->ids[i]) return -1;
+    if (map->keys[i] == val.raw) return map->ids[i] - 1;
+  }
+}
+
+// Give val the next number.
+static void ids_add(enc_ids_t *map, value_t val) {
+  if ((map->count + 1) * 2 > map->len) {
+    enc_ids_t old = *map;
+    map->len = old.len ? old.len * 2 : 64;
+    map->keys = malloc((size_t)map->len * sizeof(uint32_t));
+    map->ids = calloc((size_t)map->len, sizeof(int));
+    map->count = 0;
+    for (int i = 0; i < old.len; i++) {
+      if (!old.ids[i]) continue;
+      uint32_t mask = (uint32_t)map->len - 1;
+      uint32_t j = (old.keys[i] * 2654435761u) & mask;
+      while (map->ids[j]) j = (j + 1) & mask;
+      map->keys[j] = old.keys[i];
+      map->ids[j] = old.ids[i];
+      map->count++;
+    }
+    free(old.keys);
+    free(old.ids);
+  }
+  uint32_t mask = (uint32_t)map->len - 1;
+  uint32_t i = (val.raw * 2654435761u) & mask;
+  while (map->ids[i]) i = (i + 1) & mask;
+  map->keys[i] = val.raw;
+  map->ids[i] = ++map->count;
+}
+
+static void ids_free(enc_ids_t *map) {
+  free(map->keys);
+  free(map->ids);
+}
+
+API void bytes_put(bytes_t *out, uint8_t byte) {
+  if (out->len == out->cap) {
+    out->cap = out->cap ? out->cap * 2 : 64;
+    out->data = realloc(out->data, out->cap);
+  }
+  out->data[out->len++] = byte;
+}
+
+static void put_varint(bytes_t *out, uint32_t num) {
+  while (num >= 0x80) {
+    bytes_put(out, (uint8_t)(num | 0x80));
+    num >>= 7;
+  }
+  bytes_put(out, (uint8_t)num);
+}
+
+static void put_signed(bytes_t *out, int32_t num) {
+  put_varint(out, ((uint32_t)num << 1) ^ (uint32_t)(num >> 31));
+}
+
+// Values still to be written, last one next.
+static value_t *todo;
+static int num_todo;
+static int todo_len;
+
+static void todo_push(value_t val) {
+  if (num_todo == todo_len) {
+    todo_len = todo_len ? todo_len * 2 : 16;
+    todo = realloc(todo, (size_t)todo_len * sizeof(value_t));
+  }
+  todo[num_todo++] = val;
+}
+
+// Atoms a message may hold, the rest like EmptySlot are the heap's own
+// markers and would pass for free cells.  Both
+// sides refuse them.
+static bool atom_ok(int32_t data) {
+  return data == Nil.data || data == True.data || data == False.data ||
+    data == Undefined.data || data == TypeError.data ||
+    data == RangeError.data;
+}
+
+// Append the encoding of val to out.  False, with out left as it was, if
+// val holds an atom no message may.
+API bool encode(value_t val, bytes_t *out) {
+  enc_ids_t pairs = {0}, syms = {0};
+  bytes_t body = {0};
+  bool ok = true;
+  todo_push(val);
+  while (ok && num_todo) {
+    val = todo[--num_todo];
+    switch (val.type) {
+      case AtomType:
+        if (isNil(val)) {
+          bytes_put(&body, ENC_NIL);
+          break;
+        }
+        if (!atom_ok(val.data)) {
+          ok = false;
+          break;
+        }
+        bytes_put(&body, ENC_ATOM);
+        put_signed(&body, val.data);
+        break;
+      case IntegerType:
+        bytes_put(&body, ENC_INT);
+        put_signed(&body, val.data);
+        break;
+      case SymbolType: {
+        int index = ids_find(&syms, val);
+        if (index < 0) {
+          index = syms.count;
+          ids_add(&syms, val);
+        }
+        bytes_put(&body, ENC_SYM);
+        put_varint(&body, (uint32_t)index);
+        break;
+      }
+      case PairType: {
+        int id = ids_find(&pairs, val);
+        if (id >= 0) {
+          bytes_put(&body, ENC_REF);
+          put_varint(&body, (uint32_t)id);
+          break;
+        }
+        // Number the run, then queue its items and tail in reverse.
+        uint32_t count = 0;
+        value_t node = val;
+        while (node.type == PairType && ids_find(&pairs, node) < 0) {
+          ids_add(&pairs, node);
+          count++;
+          node = cdr(node);
+        }
+        bytes_put(&body, ENC_LIST);
+        put_varint(&body, count);
+        todo_push(node);
+        int base = num_todo;
+        for (uint32_t i = 0; i < count; i++) todo_push(next(&val));
+        for (int i = base, j = num_todo - 1; i < j; i++, j--) {
+          value_t item = todo[i];
+          todo[i] = todo[j];
+          todo[j] = item;
+        }
+        break;
+      }
+    }
+  }
+  num_todo = 0;
+  if (!ok) {
+    free(body.data);
+    ids_free(&pairs);
+    ids_free(&syms);
+    return false;
+  }
+  bytes_put(out, ENC_VERSION);
+  put_varint(out, (uint32_t)syms.count);
+  value_t *names = malloc((size_t)syms.count * sizeof(value_t));
+  for (int i = 0; i < syms.len; i++) {
+    if (syms.ids[i]) names[syms.ids[i] - 1] = (value_t){ .raw = syms.keys[i] };
+  }
+  for (int i = 0; i < syms.count; i++) {
+    const char *name = symbols_get_name(names[i].data);
+    uint32_t len = 0;
+    while (name[len]) len++;
+    put_varint(out, len);
+    for (uint32_t j = 0; j < len; j++) bytes_put(out, (uint8_t)name[j]);
+  }
+  for (size_t i = 0; i < body.len; i++) bytes_put(out, body.data[i]);
+  free(names);
+  free(body.data);
+  ids_free(&pairs);
+  ids_free(&syms);
+  return true;
+}
+
+typedef struct {
+  const uint8_t *at;
+  const uint8_t *end;
+} reader_t;
+
+static bool get_varint(reader_t *in, uint32_t *num) {
+  *num = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    if (in->at == in->end) return false;
+    uint8_t byte = *in->at++;
+    *num |= (uint32_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+static bool get_signed(reader_t *in, int32_t *num) {
+  uint32_t raw;
+  if (!get_varint(in, &raw)) return false;
+  *num = (int32_t)(raw >> 1) ^ -(int32_t)(raw & 1);
+  return true;
+}
+
+// Does num fit the 29 bits of an integer value?
+static bool int_ok(int32_t num) {
+  return num >= -(1 << 28) && num < (1 << 28);
+}
+
+// Pairs that still need a side filled in, last one next.
+typedef struct {
+  value_t pair;
+  bool right;
+} hole_t;
+
+static hole_t *holes;
+static int num_holes;
+static int holes_len;
+
+static void hole_push(value_t pair, bool right) {
+  if (num_holes == holes_len) {
+    holes_len = holes_len ? holes_len * 2 : 16;
+    holes = realloc(holes, (size_t)holes_len * sizeof(hole_t));
+  }
+  holes[num_holes++] = (hole_t){ .pair = pair, .right = right };
+}
+
+// Read one value from the len bytes at data into *out.  Gives the number of
+// bytes it took, so messages can follow each other, or -1 with *out set to
+// type-error if they don't hold a whole well formed one.
+API long decode(const uint8_t *data, size_t len, value_t *out) {
+  reader_t in = { .at = data, .end = data + len };
+  uint32_t count;
+  if (in.at == in.end || *in.at++ != ENC_VERSION || !get_varint(&in, &count) ||
+      count > (size_t)(in.end - in.at)) {
+    *out = TypeError;
+    return -1;
+  }
+  // Runs of pairs sit in pairs before they're linked in.
+  gc_pause(true);
+  value_t *syms = malloc(((size_t)count + 1) * sizeof(value_t));
+  value_t *pairs = 0;
+  uint32_t num_pairs = 0, pairs_len = 0;
+  bool ok = true;
+  for (uint32_t i = 0; ok && i < count; i++) {
+    uint32_t size;
+    ok = get_varint(&in, &size) && size && size <= (size_t)(in.end - in.at);
+    for (uint32_t j = 0; ok && j < size; j++) ok = in.at[j];
+    if (!ok) break;
+    syms[i] = (value_t){
+      .type = SymbolType,
+      .data = symbols_set((const char*)in.at, size),
+    };
+    in.at += size;
+  }
+  // The root goes in the left side of a scratch pair.
+  value_t root = cons(Undefined, Nil);
+  num_holes = 0;
+  hole_push(root, false);
+  while (ok && num_holes) {
+    hole_t hole = holes[--num_holes];
+    value_t val = Undefined;
+    uint32_t num;
+    int32_t data;
+    uint8_t tag = in.at < in.end ? *in.at++ : 0xff;
+    switch (tag) {
+      case ENC_NIL:
+        val = Nil;
+        break;
+      case ENC_ATOM:
+        ok = get_signed(&in, &data) && atom_ok(data);
+        val = (value_t){ .type = AtomType, .data = data };
+        break;
+      case ENC_INT:
+        ok = get_signed(&in, &data) && int_ok(data);
+        val = Integer(data);
+        break;
+      case ENC_SYM:
+        ok = get_varint(&in, &num) && num < count;
+        if (ok) val = syms[num];
+        break;
+      case ENC_REF:
+        ok = get_varint(&in, &num) && num < num_pairs;
+        if (ok) val = pairs[num];
+        break;
+      case ENC_LIST: {
+        // Every item takes at least a byte, which bounds the count.
+        ok = get_varint(&in, &num) && num &&
+          num <= (size_t)(in.end - in.at);
+        if (!ok) break;
+        if (num_pairs + num > pairs_len) {
+          pairs_len = (num_pairs + num) * 2;
+          pairs = realloc(pairs, pairs_len * sizeof(value_t));
+        }
+        value_t *run = pairs + num_pairs;
+        for (uint32_t i = 0; i < num; i++) run[i] = cons(Undefined, Undefined);
+        for (uint32_t i = 0; i + 1 < num; i++) set_cdr(run[i], run[i + 1]);
+        num_pairs += num;
+        hole_push(run[num - 1], true);
+        for (uint32_t i = num; i-- > 0;) hole_push(run[i], false);
+        val = run[0];
+        break;
+      }
+      default:
+        ok = false;
+    }
+    if (!ok) break;
+    if (hole.right) set_cdr(hole.pair, val);
+    else set_car(hole.pair, val);
+  }
+  free(syms);
+  free(pairs);
+  *out = free_cell(root).left;
+  gc_pause(false);
+  if (!ok) *out = TypeError;
+  return ok ? in.at - data : -1;
+}
+
+#endif
@@ -3,48 +3,98 @@
 
 #include "types.h"
 
-static void iter_int(value_t iter, value_t ctx, callback_t fn) {
-  if (iter.data == 0) return;
-  int start, end, incr;
-  if (iter.data > 0) {
-    start = 0, end = iter.data, incr = 1;
+// Iterables are pulled one item at a time through a cursor, so a range
+// costs nothing but its position.  Streams are lazy `(StreamTag source
+// stage...)` lists where each stage is `(map . fn)` or `(filter . fn)`,
+// every item of the source goes through all the stages before the next
+// one is read and no list is built in between.
+
+typedef struct {
+  value_t iter; // what's left of a list, else the iterable itself
+  int pos;      // items pulled so far
+  bool list;
+} cursor_t;
+
+static cursor_t cursor_start(value_t iter) {
+  return (cursor_t){
+    .iter = iter,
+    .list = iter.type != IntegerType && iter.type != SymbolType &&
+      is_list(iter),
+  };
+}
+
+static bool cursor_pull(cursor_t *cursor, value_t *item) {
+  value_t iter = cursor->iter;
+  int pos = cursor->pos++;
+  if (cursor->list) {
+    if (iter.type != PairType) return false;
+    *item = next(&cursor->iter);
+    return true;
   }
-  else {
-    start = -iter.data - 1, end = -1, incr = -1;
+  if (iter.type == IntegerType) {
+    // Positive numbers count up from 0, negative ones down to 0.
+    if (pos >= (iter.data < 0 ? -iter.data : iter.data)) return false;
+    *item = Integer(iter.data > 0 ? pos : -iter.data - 1 - pos);
+    return true;
   }
-  while (start != end) {
-    value_t args = cons(Integer(start), Nil);
-    fn(ctx, args);
-    free_cell(args);
-    start += incr;
+  if (iter.type == SymbolType) {
+    const char* data = symbols_get_name(iter.data);
+    if (!data[pos]) return false;
+    *item = Integer(data[pos]);
+    return true;
   }
+  if (pos) return false;
+  *item = iter;
+  return true;
 }
 
-static void iter_list(value_t iter, value_t ctx, callback_t fn) {
-  while (iter.type == PairType) {
-    value_t args = cons(next(&iter), Nil);
-    fn(ctx, args);
-    free_cell(args);
-  }
+API bool is_stream(value_t val) {
+  return val.type == PairType && eq(car(val), StreamTag);
+}
+
+// Wrap an iterable in a stream with no stages yet.
+API value_t stream_of(value_t iter) {
+  return is_stream(iter) ? iter : cons(StreamTag, cons(iter, Nil));
+}
+
+static value_t stages_add(value_t stages, value_t stage) {
+  if (stages.type != PairType) return cons(stage, Nil);
+  return cons(car(stages), stages_add(cdr(stages), stage));
 }
 
-static void iter_sym(value_t iter, value_t ctx, callback_t fn) {
-  const char* data = symbols_get_name(iter.data);
-  while (*data) {
-    value_t args = cons(Integer(*data++), Nil);
-    fn(ctx, args);
-    free_cell(args);
+// A new stream that also runs fn as a mapSym or filterSym stage, the old
+// one is left as it is.
+API value_t stream_add(value_t stream, value_t kind, value_t fn) {
+  pair_t pair = get_pair(cdr(stream));
+  return cons(StreamTag,
+    cons(pair.left, stages_add(pair.right, cons(kind, fn))));
+}
+
+// Run an item through the stages, mapping it in place.  False if a filter
+// dropped it.
+static bool stages_run(value_t stages, value_t *item) {
+  while (stages.type == PairType) {
+    pair_t stage = get_pair(next(&stages));
+    value_t result = call(stage.right, 1, item);
+    if (!eq(stage.left, filterSym)) *item = result;
+    else if (!isTruthy(result)) return false;
   }
+  return true;
 }
 
+// Call fn with each item and its index among those that made it through
+// the stages.  Items are passed on the C stack so nothing is allocated.
 API void iter_any(value_t iter, value_t ctx, callback_t fn) {
-  if (iter.type == IntegerType) iter_int(iter, ctx, fn);
-  else if (iter.type == SymbolType) iter_sym(iter, ctx, fn);
-  else if (is_list(iter)) iter_list(iter, ctx, fn);
-  else {
-    value_t args = cons(iter, Nil);
-    fn(ctx, args);
-    free_cell(args);
+  value_t stages = Nil;
+  if (is_stream(iter)) {
+    stages = cdr(cdr(iter));
+    iter = car(cdr(iter));
+  }
+  cursor_t cursor = cursor_start(iter);
+  value_t item;
+  int index = 0;
+  while (cursor_pull(&cursor, &item)) {
+    if (stages_run(stages, &item) && !fn(ctx, index++, item)) return;
   }
 }
 
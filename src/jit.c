@@ -0,0 +1,322 @@
+#ifndef JIT_C
+#define JIT_C
+
+#include "types.h"
+
+// Template jit for the vm, built with -DJIT.  Once a compiled function has
+// been entered or looped JIT_THRESHOLD times its bytecode is translated op
+// by op into fixed machine code templates.  Globals, car and cdr call the
+// same C functions as the interpreter.  Integer ops check their operand types and
+// hand back to the interpreter at the op when they don't match, as do
+// calls, closures and ret.  The machine code can be entered at any op, so
+// the interpreter goes back into it once such an op is done, see
+// JIT_RESUME in vm.c.  Only x86-64 Linux has templates, there's no
+// AArch64 or other backend: elsewhere jit_compile always fails and
+// functions stay interpreted.
+
+#ifdef JIT
+
+API bool jit_enabled = true;
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h> // for mmap, mprotect and munmap
+#include <stdlib.h>   // for realloc and free
+
+// The generated function gets base in rdi, sp in rsi and the template to
+// start at in rdx, and returns the ip and sp to continue from in rax and
+// rdx.  eax, ecx and r8d are scratch, nothing needs saving.
+
+typedef struct {
+  int at;     // where the rel32 to patch is
+  int target; // bytecode offset to jump to
+  bool exit;  // to the exit stub for target instead of its template
+} fixup_t;
+
+typedef struct {
+  code_t *code;
+  uint8_t *buf;
+  int len;
+  int buf_len;
+  int *starts;  // machine code offset of each bytecode offset
+  int *exits;   // offset of the exit stub for each, -1 if none yet
+  fixup_t *fixups;
+  int num_fixups;
+  int fixups_len;
+} jit_t;
+
+static void jit_bytes(jit_t *j, const uint8_t *bytes, int count) {
+  if (j->len + count > j->buf_len) {
+    j->buf_len += count + CODE_BLOCK_SIZE * 4;
+    j->buf = realloc(j->buf, (size_t)j->buf_len);
+  }
+  for (int i = 0; i < count; i++) j->buf[j->len++] = bytes[i];
+}
+
+#define Emit(...) jit_bytes(j, (const uint8_t[]){ __VA_ARGS__ }, \
+  sizeof((const uint8_t[]){ __VA_ARGS__ }))
+
+static void jit_32(jit_t *j, uint32_t word) {
+  Emit(word & 0xff, (word >> 8) & 0xff, (word >> 16) & 0xff, word >> 24);
+}
+
+static void jit_64(jit_t *j, uint64_t word) {
+  jit_32(j, (uint32_t)word);
+  jit_32(j, (uint32_t)(word >> 32));
+}
+
+// Emit a rel32 to be pointed at a bytecode offset (or its exit) later.
+static void jit_rel(jit_t *j, int target, bool exit) {
+  if (j->num_fixups == j->fixups_len) {
+    j->fixups_len += CODE_BLOCK_SIZE;
+    j->fixups = realloc(j->fixups, (size_t)j->fixups_len * sizeof(fixup_t));
+  }
+  j->fixups[j->num_fixups++] = (fixup_t){ j->len, target, exit };
+  jit_32(j, 0);
+}
+
+// Ops calling into C pass and get values as their raw bits.
+static uint32_t jit_global(uint32_t name) {
+  return table_get(globals, (value_t){ .raw = name }).raw;
+}
+
+static uint32_t jit_car(uint32_t pair) {
+  return car((value_t){ .raw = pair }).raw;
+}
+
+static uint32_t jit_cdr(uint32_t pair) {
+  return cdr((value_t){ .raw = pair }).raw;
+}
+
+// Call fn with the argument in eax, the result ends up in eax too.  rsp
+// is 8 off 16 byte alignment in every template, as on entry.
+static void jit_call(jit_t *j, uint32_t (*fn)(uint32_t)) {
+  Emit(0x57, 0x56);                               // push rdi, push rsi
+  Emit(0x48, 0x83, 0xec, 0x08);                   // sub rsp, 8
+  Emit(0x89, 0xc7);                               // mov edi, eax
+  Emit(0x48, 0xb8);                               // mov rax, imm64
+  jit_64(j, (uint64_t)(uintptr_t)fn);
+  Emit(0xff, 0xd0);                               // call rax
+  Emit(0x48, 0x83, 0xc4, 0x08);                   // add rsp, 8
+  Emit(0x5e, 0x5f);                               // pop rsi, pop rdi
+}
+
+// Hand back to the interpreter at bytecode offset ip.
+static void jit_exit(jit_t *j, int ip) {
+  Emit(0x48, 0xb8);                               // mov rax, imm64
+  jit_64(j, (uint64_t)(uintptr_t)(j->code->ops + ip));
+  Emit(0x48, 0x89, 0xf2);                         // mov rdx, rsi
+  Emit(0xc3);                                     // ret
+}
+
+// Check the value in reg (0 eax, 1 ecx) is an integer, else exit at ip.
+static void jit_guard_int(jit_t *j, int reg, int ip) {
+  Emit(0x41, 0x89, 0xc0 | reg << 3);              // mov r8d, reg
+  Emit(0x41, 0x83, 0xe0, 0x06);                   // and r8d, 6
+  Emit(0x41, 0x83, 0xf8, IntegerType << 1);       // cmp r8d, IntegerType
+  Emit(0x0f, 0x85);                               // jne exit
+  jit_rel(j, ip, true);
+}
+
+// Load both operands of a binary integer op into eax and ecx without
+// their tag bits.
+static void jit_int_operands(jit_t *j, int ip) {
+  Emit(0x8b, 0x46, 0xf8);                         // mov eax, [rsi-8]
+  Emit(0x8b, 0x4e, 0xfc);                         // mov ecx, [rsi-4]
+  jit_guard_int(j, 0, ip);
+  jit_guard_int(j, 1, ip);
+  Emit(0x83, 0xe0, 0xf8);                         // and eax, -8
+  Emit(0x83, 0xe1, 0xf8);                         // and ecx, -8
+}
+
+// Turn the flag tested by setcc into True or False in eax and store it as
+// the result of a binary op.
+static void jit_bool_result(jit_t *j, uint8_t setcc) {
+  Emit(0x0f, setcc, 0xc0);                        // setcc al
+  Emit(0x0f, 0xb6, 0xc0);                         // movzx eax, al
+  Emit(0xc1, 0xe0, 0x03);                         // shl eax, 3
+}
+
+static void jit_pop_result(jit_t *j) {
+  Emit(0x89, 0x46, 0xf8);                         // mov [rsi-8], eax
+  Emit(0x48, 0x83, 0xee, 0x04);                   // sub rsi, 4
+}
+
+// Emit the template for the op at ip and return the offset of the next.
+static int jit_op(jit_t *j, int ip) {
+  const uint8_t *ops = j->code->ops;
+  switch ((opcode_t)ops[ip]) {
+    case LIT:
+      Emit(0xc7, 0x06);                           // mov dword [rsi], imm32
+      jit_32(j, j->code->consts[(uint16_t)read16(ops + ip + 1)].raw);
+      Emit(0x48, 0x83, 0xc6, 0x04);               // add rsi, 4
+      return ip + 3;
+    case GET: {
+      Emit(0x8b, 0x87);                           // mov eax, [rdi+disp32]
+      jit_32(j, (uint32_t)ops[ip + 1] * sizeof(value_t));
+      Emit(0x3d);                                 // cmp eax, EmptySlot
+      jit_32(j, EmptySlot.raw);
+      Emit(0x75, 0);                              // jne set
+      int set = j->len;
+      Emit(0xb8);                                 // mov eax, imm32
+      jit_32(j, j->code->names[ops[ip + 1]].raw);
+      jit_call(j, jit_global);
+      j->buf[set - 1] = (uint8_t)(j->len - set);
+      Emit(0x89, 0x06);                           // set: mov [rsi], eax
+      Emit(0x48, 0x83, 0xc6, 0x04);               // add rsi, 4
+      return ip + 2;
+    }
+    case SET:
+      Emit(0x8b, 0x46, 0xfc);                     // mov eax, [rsi-4]
+      Emit(0x89, 0x87);                           // mov [rdi+disp32], eax
+      jit_32(j, (uint32_t)ops[ip + 1] * sizeof(value_t));
+      return ip + 2;
+    case DRP:
+      Emit(0x48, 0x83, 0xee, 0x04);               // sub rsi, 4
+      return ip + 1;
+    case JMP:
+      Emit(0xe9);                                 // jmp target
+      jit_rel(j, ip + 3 + read16(ops + ip + 1), false);
+      return ip + 3;
+    case IF:
+      // Falsy is an atom with data <= 0, see isTruthy.
+      Emit(0x48, 0x83, 0xee, 0x04);               // sub rsi, 4
+      Emit(0x8b, 0x06);                           // mov eax, [rsi]
+      Emit(0xa8, 0x06);                           // test al, 6
+      Emit(0x75, 0x0b);                           // jnz past the jle
+      Emit(0x83, 0xe0, 0xf8);                     // and eax, -8
+      Emit(0x85, 0xc0);                           // test eax, eax
+      Emit(0x0f, 0x8e);                           // jle target
+      jit_rel(j, ip + 3 + read16(ops + ip + 1), false);
+      return ip + 3;
+    case ADD:
+      jit_int_operands(j, ip);
+      Emit(0x01, 0xc8);                           // add eax, ecx
+      Emit(0x83, 0xc8, IntegerType << 1);         // or eax, IntegerType
+      jit_pop_result(j);
+      return ip + 1;
+    case SUB:
+      jit_int_operands(j, ip);
+      Emit(0x29, 0xc8);                           // sub eax, ecx
+      Emit(0x83, 0xc8, IntegerType << 1);         // or eax, IntegerType
+      jit_pop_result(j);
+      return ip + 1;
+    case LT:
+      jit_int_operands(j, ip);
+      Emit(0x39, 0xc8);                           // cmp eax, ecx
+      jit_bool_result(j, 0x9c);                   // setl
+      jit_pop_result(j);
+      return ip + 1;
+    case EQ:
+      Emit(0x8b, 0x46, 0xf8);                     // mov eax, [rsi-8]
+      Emit(0x3b, 0x46, 0xfc);                     // cmp eax, [rsi-4]
+      jit_bool_result(j, 0x94);                   // sete
+      jit_pop_result(j);
+      return ip + 1;
+    case GBL:
+      Emit(0xb8);                                 // mov eax, imm32
+      jit_32(j, j->code->consts[(uint16_t)read16(ops + ip + 1)].raw);
+      jit_call(j, jit_global);
+      Emit(0x89, 0x06);                           // mov [rsi], eax
+      Emit(0x48, 0x83, 0xc6, 0x04);               // add rsi, 4
+      return ip + 3;
+    case CAR: case CDR:
+      Emit(0x8b, 0x46, 0xfc);                     // mov eax, [rsi-4]
+      jit_call(j, ops[ip] == CAR ? jit_car : jit_cdr);
+      Emit(0x89, 0x46, 0xfc);                     // mov [rsi-4], eax
+      return ip + 1;
+    case CAL: case TCL:
+      jit_exit(j, ip);
+      return ip + 2;
+    case CLO:
+      jit_exit(j, ip);
+      return ip + 4 + 3 * ops[ip + 3];
+    case RET:
+      jit_exit(j, ip);
+      return ip + 1;
+  }
+  return -1;
+}
+
+API bool jit_compile(code_t *code) {
+  // The templates assume gcc's bitfield layout: gc in bit 0, the type in
+  // bits 1 and 2 and the data above.
+  if (Integer(1).raw != (1 << 3 | IntegerType << 1) || True.raw != 1 << 3) {
+    return false;
+  }
+  jit_t jit = {
+    .code = code,
+    .starts = malloc((size_t)code->len * sizeof(int)),
+    .exits = malloc((size_t)code->len * sizeof(int)),
+  };
+  jit_t *j = &jit;
+  for (int ip = 0; ip < code->len; ip++) j->exits[ip] = -1;
+  Emit(0xff, 0xe2);                               // jmp rdx
+  bool ok = true;
+  for (int ip = 0; ok && ip < code->len;) {
+    j->starts[ip] = j->len;
+    ip = jit_op(j, ip);
+    ok = ip > 0;
+  }
+  // Guards jump to exit stubs after the templates, one per op that needs it.
+  for (int i = 0; ok && i < j->num_fixups; i++) {
+    fixup_t fixup = j->fixups[i];
+    int target = j->starts[fixup.target];
+    if (fixup.exit) {
+      if (j->exits[fixup.target] < 0) {
+        j->exits[fixup.target] = j->len;
+        jit_exit(j, fixup.target);
+      }
+      target = j->exits[fixup.target];
+    }
+    int rel = target - (fixup.at + 4);
+    for (int b = 0; b < 4; b++) j->buf[fixup.at + b] = (uint8_t)(rel >> (8 * b));
+  }
+  void *mem = MAP_FAILED;
+  size_t size = (size_t)j->len;
+  if (ok) {
+    mem = mmap(0, size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  if (mem != MAP_FAILED) {
+    for (int i = 0; i < j->len; i++) ((uint8_t *)mem)[i] = j->buf[i];
+    // Never writable and executable at the same time.
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC)) {
+      munmap(mem, size);
+      mem = MAP_FAILED;
+    }
+  }
+  free(j->buf);
+  free(j->exits);
+  free(j->fixups);
+  if (mem == MAP_FAILED) {
+    free(j->starts);
+    return false;
+  }
+  code->jit = (jit_fn)(uintptr_t)mem;
+  code->jit_size = size;
+  code->jit_starts = j->starts;
+  return true;
+}
+
+API void jit_free(code_t *code) {
+  if (code->jit) munmap((void *)(uintptr_t)code->jit, code->jit_size);
+  free(code->jit_starts);
+}
+
+#undef Emit
+
+#else
+
+API bool jit_compile(code_t *code) {
+  (void)code;
+  return false;
+}
+
+API void jit_free(code_t *code) {
+  (void)code;
+}
+
+#endif
+#endif
+#endif
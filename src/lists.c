@@ -19,6 +19,14 @@ API int list_length(value_t list) {
   return len;
 }
 
+API value_t list_of(int len, const value_t *values) {
+  value_t list = Nil;
+  while (len--) {
+    list = cons(values[len], list);
+  }
+  return list;
+}
+
 API value_t list_reverse(value_t list) {
   value_t copy = Nil;
   while (list.type == PairType) {
@@ -0,0 +1,209 @@
+#ifndef OPTIMIZE_C
+#define OPTIMIZE_C
+
+#include "types.h"
+
+// Rewrites code lists before they run.  Calls to pure builtins with
+// constant arguments are replaced by their result, quoted numbers and
+// atoms by themselves and `if` with a constant condition by the branch it
+// takes.  Lists are changed in place, quoted data is left alone.
+
+// Builtins that only look at their arguments and never allocate.
+static const char *pure_fns[] = {
+  "+", "-", "*", "/", "%", "<", "<=", ">", ">=", "=", "!=",
+  "!", "|", "&", "^",
+};
+
+API bool is_pure(value_t fn) {
+  if (fn.type != SymbolType || fn.data < first_fn) return false;
+  for (size_t i = 0; i < sizeof(pure_fns) / sizeof(*pure_fns); i++) {
+    if (fn.data == symbols_set(pure_fns[i], 0)) return true;
+  }
+  return false;
+}
+
+// Is form a literal that evaluates to a value without side effects?
+// On success the value is stored in *val.
+static bool is_constant(value_t form, value_t *val) {
+  if (form.type == PairType) {
+    pair_t pair = get_pair(form);
+    if (!eq(pair.left, quoteSym) || pair.right.type == PairType) return false;
+    *val = pair.right;
+    return true;
+  }
+  // User symbols are variables, builtin symbols evaluate to themselves.
+  if (form.type == SymbolType && form.data < 0) return false;
+  *val = form;
+  return true;
+}
+
+static value_t fold_call(value_t form) {
+  pair_t pair = get_pair(form);
+  if (!is_pure(pair.left)) return form;
+  int argc = 0;
+  for (value_t args = pair.right; args.type == PairType; args = cdr(args)) {
+    argc++;
+  }
+  value_t argv[argc ? argc : 1];
+  value_t args = pair.right;
+  for (int i = 0; i < argc; i++) {
+    if (!is_constant(next(&args), &argv[i])) return form;
+  }
+  // Leave division by zero to fail when it runs.
+  if (eq(pair.left, Symbol("/")) || eq(pair.left, Symbol("%"))) {
+    for (int i = 1; i < argc; i++) {
+      if (eq(argv[i], Integer(0))) return form;
+    }
+  }
+  value_t result = symbols_get_native(pair.left.data)(argc, argv);
+  if (result.type == PairType) return form;
+  if (result.type == SymbolType && result.data < 0) return form;
+  return result;
+}
+
+// Builtins that iterate their first argument without keeping it.
+static const char *consumers[] = {
+  "each", "take", "reduce", "sum", "min", "max", "count",
+};
+
+static bool is_consumer(value_t fn) {
+  for (size_t i = 0; i < sizeof(consumers) / sizeof(*consumers); i++) {
+    if (eq(fn, Symbol(consumers[i]))) return true;
+  }
+  return false;
+}
+
+// Is form a call to map or filter?
+static bool is_stage(value_t form) {
+  if (form.type != PairType) return false;
+  pair_t pair = get_pair(form);
+  return (eq(pair.left, mapSym) || eq(pair.left, filterSym)) &&
+    pair.right.type == PairType;
+}
+
+// A map or filter over another one, or under a consumer, is fused into a
+// single lazy pass by making the innermost source a stream.  Unless a
+// consumer takes the result, take collects it back into a list.
+static value_t fuse(value_t form) {
+  if (!is_stage(form) && !is_consumer(car(form))) return form;
+  value_t source = car(cdr(form));
+  if (!is_stage(source)) return form;
+  while (is_stage(car(cdr(source)))) source = car(cdr(source));
+  value_t args = cdr(source);
+  value_t inner = car(args);
+  if (inner.type == PairType && eq(car(inner), streamSym)) return form;
+  set_car(args, cons(streamSym, cons(inner, Nil)));
+  return is_stage(form) ? cons(takeSym, cons(form, Nil)) : form;
+}
+
+API value_t optimize(value_t form) {
+  if (form.type != PairType) return form;
+  pair_t pair = get_pair(form);
+  if (eq(pair.left, quoteSym)) {
+    return pair.right.type == PairType ||
+      (pair.right.type == SymbolType && pair.right.data < 0) ?
+      form : pair.right;
+  }
+  form = fuse(form);
+  pair = get_pair(form);
+  for (value_t node = form; node.type == PairType; node = cdr(node)) {
+    set_car(node, optimize(car(node)));
+  }
+  value_t cond;
+  if (eq(pair.left, ifSym) && is_constant(car(pair.right), &cond)) {
+    value_t branches = cdr(pair.right);
+    return isTruthy(cond) ? car(branches) : car(cdr(branches));
+  }
+  return fold_call(form);
+}
+
+// True if form can reach its environment other than through plain
+// `(get 'name)` and `(set 'name value)`, making variables unpredictable.
+static bool is_dynamic(value_t form) {
+  if (form.type != PairType) return false;
+  value_t head = next(&form);
+  if (eq(head, quoteSym)) return false;
+  if (eq(head, getSym) || eq(head, setSym)) {
+    bool key = true;
+    while (form.type == PairType) {
+      value_t arg = next(&form);
+      if (key) {
+        if (arg.type != PairType || !eq(car(arg), quoteSym) ||
+            cdr(arg).type != SymbolType || cdr(arg).data >= 0) return true;
+      }
+      else if (is_dynamic(arg)) return true;
+      // get only has a key, set alternates keys and values.
+      key = eq(head, getSym) || !key;
+    }
+    return false;
+  }
+  if (head.type == SymbolType && head.data >= 0 && head.data < first_fn &&
+      !eq(head, doSym) && !eq(head, ifSym) && !eq(head, whileSym)) {
+    return true;
+  }
+  if (is_dynamic(head)) return true;
+  while (form.type == PairType) {
+    if (is_dynamic(next(&form))) return true;
+  }
+  return false;
+}
+
+static int count_sets(value_t form, value_t name) {
+  if (form.type != PairType) return 0;
+  value_t head = next(&form);
+  if (eq(head, quoteSym)) return 0;
+  int count = 0;
+  if (eq(head, setSym)) {
+    while (form.type == PairType) {
+      if (eq(cdr(next(&form)), name)) count++;
+      count += count_sets(next(&form), name);
+    }
+    return count;
+  }
+  count += count_sets(head, name);
+  while (form.type == PairType) {
+    count += count_sets(next(&form), name);
+  }
+  return count;
+}
+
+static value_t substitute(value_t form, value_t name, value_t val) {
+  if (eq(form, name)) return val;
+  if (form.type != PairType) return form;
+  pair_t pair = get_pair(form);
+  if (eq(pair.left, quoteSym)) return form;
+  if (eq(pair.left, getSym) && eq(cdr(car(pair.right)), name)) return val;
+  for (value_t node = form; node.type == PairType; node = cdr(node)) {
+    set_car(node, substitute(car(node), name, val));
+  }
+  return form;
+}
+
+// Optimize a function list `(params body...)`.  Top level statements of
+// the form `(set 'name constant)` where name is set nowhere else also
+// replace name in the statements after them, unless the body could read
+// or write its environment some other way.
+API void optimize_fn(value_t fn) {
+  if (fn.type != PairType) return;
+  value_t body = cdr(fn);
+  bool dynamic = false;
+  for (value_t node = body; node.type == PairType; node = cdr(node)) {
+    if (is_dynamic(car(node))) dynamic = true;
+  }
+  for (value_t node = body; node.type == PairType; node = cdr(node)) {
+    value_t stmt = optimize(car(node));
+    set_car(node, stmt);
+    if (dynamic || stmt.type != PairType || !eq(car(stmt), setSym)) continue;
+    value_t args = cdr(stmt);
+    value_t name = cdr(car(args));
+    value_t form = car(cdr(args));
+    value_t val;
+    if (cdr(cdr(args)).type == PairType || !is_constant(form, &val) ||
+        count_sets(body, name) != 1) continue;
+    for (value_t rest = cdr(node); rest.type == PairType; rest = cdr(rest)) {
+      set_car(rest, substitute(car(rest), name, form));
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef PARALLEL_C
+#define PARALLEL_C
+
+#include "types.h"
+#include <stdlib.h> // for malloc and free
+
+// pmap and pfilter, run across threads when built with -DTHREADS.  Nothing
+// guards the heap, so a worker may only run a function that never
+// allocates or writes outside its own frame:
+//
+// - a pure builtin, see optimize.c
+// - a compiled function or closure that calls nothing but pure builtins
+//   and builds no closures, the vm stack being per thread.  With the jit
+//   it must already be jitted, entering it would count calls otherwise.
+//
+// The results are then values that already exist and nothing needs to be
+// merged back into the heap.  Anything else runs in order on the calling
+// thread, as do short lists.  Items are split into one run per thread.
+
+typedef struct {
+  value_t fn;
+  code_t *code;
+  value_t *items;
+  value_t *results;
+  int count;
+} par_run_t;
+
+static void *par_work(void *arg) {
+  par_run_t *run = arg;
+  for (int i = 0; i < run->count; i++) {
+    run->results[i] = run->code ?
+      vm_call(run->fn, run->code, 1, run->items + i) :
+      call(run->fn, 1, run->items + i);
+  }
+  return 0;
+}
+
+#ifdef THREADS
+#include <pthread.h>
+
+API int par_threads = PAR_THREADS;
+
+// Can fn run on a worker thread?  Sets *code for compiled functions.
+static bool par_safe(value_t fn, code_t **code) {
+  *code = 0;
+  if (is_pure(fn)) return true;
+  *code = vm_enabled ? code_find(fn) : 0;
+  if (!*code || (*code)->impure) return false;
+#ifdef JIT
+  if (jit_enabled && !(*code)->jit) return false;
+#endif
+  return true;
+}
+
+// Split the items into a run per thread, the calling thread doing the
+// first.  A thread that can't be started leaves its run to the caller.
+static void par_spread(par_run_t all) {
+  int threads = par_threads < all.count ? par_threads : all.count;
+  par_run_t runs[threads];
+  pthread_t ids[threads];
+  bool started[threads];
+  for (int t = 0; t < threads; t++) {
+    int from = (int)((long)all.count * t / threads);
+    int to = (int)((long)all.count * (t + 1) / threads);
+    runs[t] = all;
+    runs[t].items += from;
+    runs[t].results += from;
+    runs[t].count = to - from;
+    started[t] = t && !pthread_create(&ids[t], 0, par_work, &runs[t]);
+  }
+  par_work(&runs[0]);
+  for (int t = 1; t < threads; t++) {
+    if (started[t]) pthread_join(ids[t], 0);
+    else par_work(&runs[t]);
+  }
+}
+#endif
+
+// Call fn on every item of list, giving the list of results or with keep
+// the list of items it returned something truthy for.
+API value_t par_map(value_t fn, value_t list, bool keep) {
+  int count = list_length(list);
+  if (!count) return Nil;
+  // Nothing sees the items and results, nor do threads share the heap.
+  gc_pause(true);
+  value_t *items = malloc((size_t)count * 2 * sizeof(value_t));
+  value_t *results = items + count;
+  for (int i = 0; i < count; i++) items[i] = next(&list);
+  par_run_t all = {
+    .fn = fn,
+    .items = items,
+    .results = results,
+    .count = count,
+  };
+#ifdef THREADS
+  if (count >= PAR_MIN_ITEMS && par_threads > 1 && par_safe(fn, &all.code)) {
+    par_spread(all);
+  }
+  else
+#endif
+  {
+    all.code = 0;
+    par_work(&all);
+  }
+  value_t out = Nil;
+  for (int i = count - 1; i >= 0; i--) {
+    if (!keep) out = cons(results[i], out);
+    else if (isTruthy(results[i])) out = cons(items[i], out);
+  }
+  free(items);
+  gc_pause(false);
+  return out;
+}
+
+#endif
@@ -2,65 +2,308 @@
 #define PRINT_C
 
 #include "types.h"
-#include <unistd.h> // for write syscall
+#include <unistd.h>  // for isatty
+#include <sys/uio.h> // for writev
+#include <errno.h>   // for EINTR
+
+// Output is line buffered on a terminal, so a line shows up as soon as it's
+// complete, and fully buffered otherwise, so output piped into a file costs
+// one write per WRITE_BUFFER_LENGTH bytes instead of one per line.  Build
+// with PRINT_MODE set to force either, print_flush writes everything out.
 
 static char write_buffer[WRITE_BUFFER_LENGTH];
 static size_t write_index;
+static print_mode_t print_mode = PRINT_MODE;
+static int out_fd = 1;
+
+static bool line_buffered() {
+  if (print_mode == PRINT_AUTO) {
+    print_mode = isatty(1) ? PRINT_LINE : PRINT_FULL;
+  }
+  return print_mode == PRINT_LINE;
+}
+
+// Two digits at a time, "00" to "99".
+static const char digit_pairs[] =
+  "00010203040506070809101112131415161718192021222324"
+  "25262728293031323334353637383940414243444546474849"
+  "50515253545556575859606162636465666768697071727374"
+  "75767778798081828384858687888990919293949596979899";
+
+// Format num right to left ending at end, returns where it starts.
+static char *format_uint(char *end, unsigned num) {
+  while (num >= 100) {
+    const char *pair = digit_pairs + num % 100 * 2;
+    num /= 100;
+    *--end = pair[1];
+    *--end = pair[0];
+  }
+  if (num >= 10) {
+    *--end = digit_pairs[num * 2 + 1];
+    *--end = digit_pairs[num * 2];
+  }
+  else {
+    *--end = (char)('0' + num);
+  }
+  return end;
+}
+
+// Write all of iov out, carrying on after short writes and signals.
+static void write_all(struct iovec *iov, int count) {
+  while (count) {
+    ssize_t written = writev(out_fd, iov, count);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    while (count && (size_t)written >= iov->iov_len) {
+      written -= (ssize_t)iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= (size_t)written;
+    }
+  }
+}
+
+#ifdef PRINT_ASYNC
+#include <pthread.h>   // for the writer thread
+#include <stdatomic.h> // for the ring indexes
+#include <time.h>      // for clock_gettime and nanosleep
 
-static bool needFlush;
+// With -DPRINT_ASYNC flushed output goes into a single producer, single
+// consumer ring that a writer thread drains, so a slow console never
+// blocks the evaluator in write().  The lock is only taken to wake the
+// writer when it's gone to sleep on an empty ring.  When the ring is full
+// PRINT_OVERFLOW decides: PRINT_BLOCK waits for room, PRINT_DROP throws
+// the new output away and PRINT_COUNT does too but writes how many bytes
+// went missing once there's room again.  Drops and the slowest write are
+// kept in print_stats.
+
+static char ring[PRINT_RING_SIZE];
+static atomic_size_t ring_head; // only moved by the evaluator
+static atomic_size_t ring_tail; // only moved by the writer
+static atomic_bool writer_idle;
+static atomic_long slowest_write;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_wake = PTHREAD_COND_INITIALIZER;
+static enum { WRITER_NONE, WRITER_RUNNING, WRITER_FAILED } writer;
+static long dropped;
+static long unreported; // dropped but not yet told about, PRINT_COUNT
+
+static long now_us() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void nap() {
+  nanosleep(&(struct timespec){ .tv_nsec = 100000 }, 0);
+}
+
+static void *writer_run(void *arg) {
+  (void)arg;
+  for (;;) {
+    size_t tail = atomic_load(&ring_tail);
+    size_t head = atomic_load(&ring_head);
+    if (head == tail) {
+      pthread_mutex_lock(&writer_lock);
+      atomic_store(&writer_idle, true);
+      while (atomic_load(&ring_head) == tail) {
+        pthread_cond_wait(&writer_wake, &writer_lock);
+      }
+      atomic_store(&writer_idle, false);
+      pthread_mutex_unlock(&writer_lock);
+      continue;
+    }
+    size_t start = tail % PRINT_RING_SIZE;
+    size_t len = head - tail;
+    size_t first = len < PRINT_RING_SIZE - start ? len : PRINT_RING_SIZE - start;
+    struct iovec iov[] = {
+      { ring + start, first },
+      { ring, len - first },
+    };
+    long began = now_us();
+    write_all(iov, 2);
+    long took = now_us() - began;
+    if (took > atomic_load(&slowest_write)) atomic_store(&slowest_write, took);
+    atomic_store(&ring_tail, head);
+  }
+  return 0;
+}
+
+static bool writer_ready() {
+  if (writer == WRITER_NONE) {
+    pthread_t id;
+    writer = pthread_create(&id, 0, writer_run, 0) ?
+      WRITER_FAILED : WRITER_RUNNING;
+    if (writer == WRITER_RUNNING) pthread_detach(id);
+  }
+  return writer == WRITER_RUNNING;
+}
+
+static size_t ring_room() {
+  return PRINT_RING_SIZE -
+    (atomic_load(&ring_head) - atomic_load(&ring_tail));
+}
+
+// Copy len bytes in, all of them or, unless blocking, none.
+static void ring_write(const char *data, size_t len) {
+  while (len) {
+    size_t room = ring_room();
+    if (PRINT_OVERFLOW != PRINT_BLOCK && room < len) {
+      dropped += (long)len;
+      unreported += (long)len;
+      return;
+    }
+    if (!room) {
+      nap();
+      continue;
+    }
+    size_t count = len < room ? len : room;
+    size_t head = atomic_load(&ring_head);
+    for (size_t i = 0; i < count; i++) {
+      ring[(head + i) % PRINT_RING_SIZE] = data[i];
+    }
+    atomic_store(&ring_head, head + count);
+    data += count;
+    len -= count;
+    if (atomic_load(&writer_idle)) {
+      pthread_mutex_lock(&writer_lock);
+      pthread_cond_signal(&writer_wake);
+      pthread_mutex_unlock(&writer_lock);
+    }
+  }
+}
+
+// Tell about dropped output once the note fits.
+static void report_drops() {
+  static const char text[] = " bytes dropped]\n";
+  char note[48];
+  char *end = note + 16;
+  char *start = format_uint(end, (unsigned)unreported);
+  *--start = '[';
+  *--start = '\n';
+  for (size_t i = 0; i < sizeof(text) - 1; i++) end[i] = text[i];
+  size_t len = (size_t)(end - start) + sizeof(text) - 1;
+  if (ring_room() < len) return;
+  unreported = 0;
+  ring_write(start, len);
+}
+#endif
+
+// Send iov on its way, to the writer thread if there is one.
+static void output(struct iovec *iov, int count) {
+#ifdef PRINT_ASYNC
+  if (writer_ready()) {
+    if (PRINT_OVERFLOW == PRINT_COUNT && unreported) report_drops();
+    for (int i = 0; i < count; i++) ring_write(iov[i].iov_base, iov[i].iov_len);
+    return;
+  }
+#endif
+  write_all(iov, count);
+}
 
 API void print_flush() {
-  write(1, write_buffer, write_index);
+  if (!write_index) return;
+  struct iovec iov = { write_buffer, write_index };
+  output(&iov, 1);
   write_index = 0;
-  needFlush = false;
+}
+
+// Flush and wait until everything has been written.
+API print_stats_t print_wait() {
+  print_flush();
+  print_stats_t stats = { 0, 0 };
+#ifdef PRINT_ASYNC
+  while (writer == WRITER_RUNNING && ring_room() < PRINT_RING_SIZE) nap();
+  stats.dropped = dropped;
+  stats.slowest_write = atomic_load(&slowest_write);
+#endif
+  return stats;
+}
+
+// Write what's pending, then send output to fd, like 2 for stderr.
+API void print_to(int fd) {
+  print_wait();
+  out_fd = fd;
 }
 
 static void check() {
   if (write_index == WRITE_BUFFER_LENGTH) print_flush();
 }
 
+// Make room for len more bytes, flushing if they wouldn't fit.
+static void reserve(size_t len) {
+  if (write_index + len > WRITE_BUFFER_LENGTH) print_flush();
+}
+
+static void print_chars(const char *start, const char *end) {
+  reserve((size_t)(end - start));
+  while (start < end) write_buffer[write_index++] = *start++;
+}
+
+// Right aligned in width columns, pass 0 for no padding.
+API bool print_int_width(int num, int width) {
+  char buf[32];
+  char *end = buf + sizeof(buf);
+  // Negate as unsigned so INT_MIN works too.
+  char *start = format_uint(end, num < 0 ? 0u - (unsigned)num : (unsigned)num);
+  if (num < 0) *--start = '-';
+  while (end - start < width && start > buf) *--start = ' ';
+  print_chars(start, end);
+  return true;
+}
+
 API bool print_int(int num) {
-  int digit = 1;
-  if (num < 0) {
-    check();
-    write_buffer[write_index++] = '-';
-    num = -num;
-  }
-  while (digit <= num) { digit *= 10; }
-  if (digit > 1) digit /= 10;
-  while (digit > 0) {
-    check();
-    write_buffer[write_index++] = 48 + ((num / digit) % 10);
-    digit /= 10;
-  }
+  return print_int_width(num, 0);
+}
+
+// Lowercase hex digits zero padded to width, for register dumps.
+API bool print_hex(unsigned num, int width) {
+  char buf[32];
+  char *end = buf + sizeof(buf);
+  char *start = end;
+  do {
+    *--start = "0123456789abcdef"[num & 15];
+    num >>= 4;
+  } while (num);
+  while (end - start < width && start > buf) *--start = '0';
+  print_chars(start, end);
   return true;
 }
 
 API bool print_char(const char c) {
   check();
   write_buffer[write_index++] = c;
-  if (c == '\n') print_flush();
+  if (c == '\n' && line_buffered()) print_flush();
   return true;
 }
 
 API bool print(const char* value) {
   if (!value) return false;
-  while (*value) {
-    check();
-    write_buffer[write_index++] = *value;
-    if (*value++ == '\n') needFlush = true;
-  }
-  if (needFlush) print_flush();
-  return true;
+  size_t len = 0;
+  while (value[len]) len++;
+  return print_string(value, len);
 }
 
+// Strings that don't fit go out in one writev along with the buffer.
 API bool print_string(const char* value, size_t len) {
-  for (size_t i = 0; i < len; i++) {
-    check();
-    write_buffer[write_index++] = value[i];
-    if (value[i] == '\n') needFlush = true;
+  bool newline = false;
+  for (size_t i = 0; i < len && !newline; i++) newline = value[i] == '\n';
+  if (write_index + len > WRITE_BUFFER_LENGTH) {
+    struct iovec iov[] = {
+      { write_buffer, write_index },
+      { (void *)value, len },
+    };
+    output(iov, 2);
+    write_index = 0;
+    return true;
   }
-  if (needFlush) print_flush();
+  for (size_t i = 0; i < len; i++) write_buffer[write_index++] = value[i];
+  if (newline && line_buffered()) print_flush();
   return true;
 }
 
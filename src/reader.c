@@ -0,0 +1,337 @@
+#ifndef READER_C
+#define READER_C
+
+#include "types.h"
+#include <stdlib.h> // for realloc and free
+#include <string.h> // for memchr and memcpy
+
+// Source text is read into forms a chunk at a time, the parser keeping
+// where it was between chunks, so input can come in pieces of any size and
+// a form may span lines.  Top level forms are handed out as soon as they
+// close, what's kept meanwhile is the lists still open and the token being
+// read.
+
+// Bump when the same source would read differently, caches of parsed
+// scripts made by an older reader are dropped then.
+#define READER_VERSION 1
+
+// Look for dots and parse into list of symbols if found.
+static value_t getSymbols(const char* start, const char* end) {
+  value_t parts = Nil;
+  const char* s = start;
+  const char* i = s;
+  while (i < end) {
+    if (*i == '.' && i > s) {
+      value_t sym = SymbolRange(s, i);
+      parts = cons(sym, parts);
+      s = i + 1;
+    }
+    i++;
+  }
+  if (isNil(parts)) return SymbolRange(start, end);
+  return list_ireverse(cons(SymbolRange(s,end), parts));
+}
+
+static bool is_space(char c) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static bool ends_symbol(char c) {
+  return is_space(c) || c == '(' || c == ')' || c == '[' || c == ']';
+}
+
+// Symbols and runs of whitespace are skipped over 16 bytes at a time where
+// there's SSE2 or NEON, each byte compared against every delimiter at once
+// and the first hit found from the resulting mask.  Build with READ_SCALAR
+// to go byte by byte everywhere.
+#if !defined(READ_SCALAR) && defined(__SSE2__)
+#include <emmintrin.h>
+#define READ_SIMD
+
+// Bit i is set for each of the 16 bytes at p that's whitespace, with
+// brackets also set for ( ) [ and ].
+static unsigned classify16(const char *p, bool brackets) {
+  __m128i v = _mm_loadu_si128((const __m128i *)p);
+  __m128i hits = _mm_or_si128(
+    _mm_or_si128(
+      _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+      _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))),
+    _mm_or_si128(
+      _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')),
+      _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))));
+  if (brackets) {
+    hits = _mm_or_si128(hits, _mm_or_si128(
+      _mm_or_si128(
+        _mm_cmpeq_epi8(v, _mm_set1_epi8('(')),
+        _mm_cmpeq_epi8(v, _mm_set1_epi8(')'))),
+      _mm_or_si128(
+        _mm_cmpeq_epi8(v, _mm_set1_epi8('[')),
+        _mm_cmpeq_epi8(v, _mm_set1_epi8(']')))));
+  }
+  return (unsigned)_mm_movemask_epi8(hits);
+}
+#elif !defined(READ_SCALAR) && defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define READ_SIMD
+
+static unsigned classify16(const char *p, bool brackets) {
+  uint8x16_t v = vld1q_u8((const uint8_t *)p);
+  uint8x16_t hits = vorrq_u8(
+    vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')), vceqq_u8(v, vdupq_n_u8('\n'))),
+    vorrq_u8(vceqq_u8(v, vdupq_n_u8('\r')), vceqq_u8(v, vdupq_n_u8('\t'))));
+  if (brackets) {
+    hits = vorrq_u8(hits, vorrq_u8(
+      vorrq_u8(vceqq_u8(v, vdupq_n_u8('(')), vceqq_u8(v, vdupq_n_u8(')'))),
+      vorrq_u8(vceqq_u8(v, vdupq_n_u8('[')), vceqq_u8(v, vdupq_n_u8(']')))));
+  }
+  // No movemask on NEON, weigh each lane's bit and add up the halves.
+  static const uint8_t weights[16] = {
+    1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128,
+  };
+  uint8x16_t bits = vandq_u8(hits, vld1q_u8(weights));
+  return vaddv_u8(vget_low_u8(bits)) |
+    (unsigned)vaddv_u8(vget_high_u8(bits)) << 8;
+}
+#endif
+
+// Where the symbol starting at p ends, end if it goes on past the chunk.
+static const char *symbol_scan(const char *p, const char *end) {
+#ifdef READ_SIMD
+  for (; end - p >= 16; p += 16) {
+    unsigned hits = classify16(p, true);
+    if (hits) return p + __builtin_ctz(hits);
+  }
+#endif
+  while (p < end && !ends_symbol(*p)) p++;
+  return p;
+}
+
+static const char *space_skip(const char *p, const char *end) {
+#ifdef READ_SIMD
+  // Mostly a single space between tokens, only indentation is worth it.
+  if (p < end && is_space(*p)) {
+    for (; end - p >= 16; p += 16) {
+      unsigned others = ~classify16(p, false) & 0xffff;
+      if (others) return p + __builtin_ctz(others);
+    }
+  }
+#endif
+  while (p < end && is_space(*p)) p++;
+  return p;
+}
+
+static void token_add(parser_t *parser, const char *data, size_t len) {
+  if (parser->len + len > parser->cap) {
+    while (parser->len + len > parser->cap) {
+      parser->cap = parser->cap ? parser->cap * 2 : 32;
+    }
+    parser->token = realloc(parser->token, parser->cap);
+  }
+  memcpy(parser->token + parser->len, data, len);
+  parser->len += len;
+}
+
+// Add a finished item to the open list, or at the top level to the forms
+// ready to be taken.
+static void item_add(parser_t *parser, value_t atom) {
+  if (parser->quote) {
+    parser->quote = false;
+    atom = cons(quoteSym, atom);
+  }
+  if (parser->stack.type == PairType) {
+    parser->value = cons(atom, parser->value);
+  }
+  else {
+    parser->forms = cons(atom, parser->forms);
+  }
+}
+
+static void symbol_end(parser_t *parser, const char *start, size_t len) {
+  value_t atom;
+  if (len == 1 && start[0] == '.') {
+    atom = Dot;
+  }
+  else if (len == 3 &&
+      start[0] == 'n' &&
+      start[1] == 'i' &&
+      start[2] == 'l') {
+    atom = Nil;
+  }
+  else if (len == 4 &&
+      start[0] == 't' &&
+      start[1] == 'r' &&
+      start[2] == 'u' &&
+      start[3] == 'e') {
+    atom = True;
+  }
+  else if (len == 5 &&
+      start[0] == 'f' &&
+      start[1] == 'a' &&
+      start[2] == 'l' &&
+      start[3] == 's' &&
+      start[4] == 'e') {
+    atom = False;
+  }
+  else {
+    atom = getSymbols(start, start + len);
+  }
+  // A dot at the top level has nothing to join.
+  if (parser->stack.type != PairType && eq(atom, Dot)) return;
+  item_add(parser, atom);
+}
+
+// Strings are quoted symbols, there's no empty symbol so "" reads as nil.
+static void string_end(parser_t *parser, const char *start, size_t len) {
+  item_add(parser, len ? cons(quoteSym, SymbolRange(start, start + len)) : Nil);
+}
+
+// Finish a token that ends at stop, straight from the input unless part of
+// it came in an earlier chunk.
+static void token_end(parser_t *parser, const char *data, const char *stop,
+    void (*end)(parser_t *parser, const char *start, size_t len)) {
+  if (!parser->len) {
+    end(parser, data, (size_t)(stop - data));
+    return;
+  }
+  token_add(parser, data, (size_t)(stop - data));
+  end(parser, parser->token, parser->len);
+  parser->len = 0;
+}
+
+static void list_open(parser_t *parser, char c) {
+  parser->stack = cons(parser->value, parser->stack);
+  parser->value = Nil;
+  if (parser->quote) {
+    parser->quote = false;
+    parser->value = cons(quoteSym, parser->value);
+  }
+  if (c == '[') {
+    parser->value = cons(listSym, parser->value);
+  }
+}
+
+static void list_close(parser_t *parser) {
+  if (parser->stack.type != PairType) return;
+  value_t value = parser->value;
+  value_t fixed = Nil;
+  bool dot = false;
+  while (value.type == PairType) {
+    pair_t pair = get_pair(value);
+    if (eq(pair.left, Dot)) {
+      dot = true;
+    }
+    else {
+      if (dot) {
+        dot = false;
+        fixed = free_cell(fixed).left;
+      }
+      set_cdr(value, fixed);
+      fixed = value;
+    }
+    value = pair.right;
+  }
+  parser->value = car(parser->stack);
+  parser->stack = free_cell(parser->stack).right;
+  item_add(parser, fixed);
+}
+
+// Read len bytes of source, carrying on from the previous call.
+API void parser_feed(parser_t *parser, const char *data, size_t len) {
+  const char *end = data + len;
+  while (data < end) {
+    char c = *data;
+    switch (parser->state) {
+      case READ_NUMBER:
+        if (c >= '0' && c <= '9') {
+          parser->num = parser->num * 10 + c - '0';
+          data++;
+          continue;
+        }
+        item_add(parser, Integer(parser->neg ? -parser->num : parser->num));
+        parser->neg = false;
+        parser->state = READ_NONE;
+        continue;
+      case READ_MINUS:
+        // A minus is a negative number's sign or starts a symbol.
+        if (c >= '0' && c <= '9') {
+          parser->neg = true;
+          parser->num = 0;
+          parser->state = READ_NUMBER;
+          continue;
+        }
+        token_add(parser, "-", 1);
+        parser->state = READ_SYMBOL;
+        continue;
+      case READ_SYMBOL: {
+        const char *stop = symbol_scan(data, end);
+        if (stop == end) {
+          token_add(parser, data, (size_t)(end - data));
+          return;
+        }
+        token_end(parser, data, stop, symbol_end);
+        parser->state = READ_NONE;
+        data = stop;
+        continue;
+      }
+      case READ_STRING: {
+        const char *stop = memchr(data, '"', (size_t)(end - data));
+        if (!stop) {
+          token_add(parser, data, (size_t)(end - data));
+          return;
+        }
+        token_end(parser, data, stop, string_end);
+        parser->state = READ_NONE;
+        data = stop + 1;
+        continue;
+      }
+      case READ_NONE:
+        break;
+    }
+    data = space_skip(data, end);
+    if (data == end) return;
+    c = *data++;
+    if (c == '(' || c == '[') list_open(parser, c);
+    else if (c == ')' || c == ']') list_close(parser);
+    else if (c == '\'') parser->quote = true;
+    else if (c == '-') parser->state = READ_MINUS;
+    else if (c >= '0' && c <= '9') {
+      parser->num = c - '0';
+      parser->state = READ_NUMBER;
+    }
+    else if (c == '"') parser->state = READ_STRING;
+    else {
+      // Scanned from its first byte on.
+      data--;
+      parser->state = READ_SYMBOL;
+    }
+  }
+}
+
+// The forms that closed since last time, in order.
+API value_t parser_take(parser_t *parser) {
+  value_t forms = list_ireverse(parser->forms);
+  parser->forms = Nil;
+  return forms;
+}
+
+// End of input: finish the token being read and drop lists left open.
+// Input cut off inside a string or list is told in *problem, if given,
+// which is 0 otherwise.
+API value_t parser_end(parser_t *parser, const char **problem) {
+  const char *cut = 0;
+  if (parser->state == READ_STRING) {
+    cut = "unterminated string";
+  }
+  else {
+    parser_feed(parser, " ", 1);
+    if (parser->stack.type == PairType) cut = "unclosed list";
+  }
+  if (problem) *problem = cut;
+  free(parser->token);
+  free_list(parser->stack);
+  value_t forms = parser_take(parser);
+  *parser = Parser();
+  return forms;
+}
+
+#endif
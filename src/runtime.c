@@ -40,35 +40,147 @@ static void full_dump(value_t val) {
 #endif
 #endif
 
+API value_t globals;
 
+// Variables resolve in the local environment first, then in globals.
+API value_t lookup(value_t env, value_t key) {
+  value_t mapping = table_mapping(env, key);
+  if (mapping.type == PairType) return cdr(mapping);
+  if (eq(env, globals)) return Undefined;
+  return table_get(globals, key);
+}
+
+static bool is_keyword_call(value_t val) {
+  value_t head = car(val);
+  return head.type == SymbolType && head.data >= 0 && head.data < first_fn;
+}
+
+// What the argument in cell is: a value of its own, a variable at most
+// QUICK_SLOTS cells into env, or something to evaluate.
+static quick_t quicken_arg(value_t env, value_t cell) {
+  #ifdef TRACE
+    return Q_ARG;
+  #endif
+  value_t arg = car(cell);
+  if (arg.type == IntegerType || arg.type == AtomType ||
+      (arg.type == SymbolType && arg.data >= 0)) return Q_CONST;
+  if (arg.type != SymbolType) return Q_ARG;
+  for (int slot = 0; slot < QUICK_SLOTS && env.type == PairType; slot++) {
+    pair_t pair = get_pair(env);
+    if (eq(car(pair.left), arg)) return Q_SLOT + slot;
+    env = pair.right;
+  }
+  return Q_ARG;
+}
+
+// Evaluate the argument in an argument list cell.  A variable is looked
+// for where it was found last time first, environments of the same
+// function being laid out alike, and if it isn't there the cell goes back
+// to plain evaluation.
+static value_t eval_arg(value_t env, value_t cell) {
+  quick_t quick = get_quick(cell);
+  if (quick < Q_ARG) {
+    quick = quicken_arg(env, cell);
+    set_quick(cell, quick);
+  }
+  value_t arg = car(cell);
+  if (quick == Q_CONST) return arg;
+  if (quick >= Q_SLOT) {
+    value_t node = env;
+    for (int i = quick - Q_SLOT; i > 0 && node.type == PairType; i--) {
+      node = cdr(node);
+    }
+    pair_t mapping = get_pair(car(node));
+    if (eq(mapping.left, arg)) return mapping.right;
+    set_quick(cell, Q_ARG);
+  }
+  return eval(env, arg);
+}
+
+// Evaluate each expression of a list into argv.
+static void eval_args(value_t env, value_t list, value_t *argv) {
+  while (list.type == PairType) {
+    *argv++ = eval_arg(env, list);
+    list = cdr(list);
+  }
+}
+
+static quick_t quicken(pair_t form) {
+  #ifdef TRACE
+    // Keep the trace of every call.
+    return Q_GENERIC;
+  #endif
+  value_t head = form.left;
+  if (head.type != SymbolType || head.data < 0) return Q_GENERIC;
+  if (head.data < first_fn) return Q_KEYWORD;
+  if (!symbols_get_native(head.data)) return Q_GENERIC;
+  int argc = list_length(form.right);
+  return argc <= QUICK_ARGS ? Q_NATIVE_N + argc : Q_NATIVE;
+}
+
+// A form is quickened the first time it runs: its head cell is marked as
+// a keyword call, a builtin call with so many arguments or something
+// generic, and the cells of its argument list as constants, variables
+// found at some place in the environment or other expressions.  Later runs
+// go straight to that case.
 static value_t __eval(value_t env, value_t val) {
   // Symbols look up in environment or return self for builtins.
   if (val.type == SymbolType) {
-    return val.data < 0 ? table_get(env, val) : val;
+    return val.data < 0 ? lookup(env, val) : val;
   }
   // Simple types are returned unchanged.
   if (val.type != PairType) return val;
-  value_t head = next(&val);
-  if (head.type == SymbolType && head.data >= 0 && head.data < first_fn) {
+  // Forms are classified once and run straight from then on, until the
+  // cell is written again.
+  pair_t pair = get_pair(val);
+  quick_t quick = get_quick(val);
+  if (quick == Q_NONE || quick >= Q_ARG) {
+    quick = quicken(pair);
+    set_quick(val, quick);
+  }
+  if (quick == Q_KEYWORD) {
     // For keywords, inject environment and don't evaluate arguments.
-    return apply(head, cons(env, val));
+    return symbols_get_fn(pair.left.data)(cons(env, pair.right));
+  }
+  if (quick >= Q_NATIVE_N) {
+    // The argument count is only checked after, an edit further down the
+    // list doesn't reset the head's cell.
+    int argc = quick - Q_NATIVE_N;
+    value_t argv[QUICK_ARGS];
+    value_t args = pair.right;
+    int have = 0;
+    while (have < argc && args.type == PairType) {
+      argv[have++] = eval_arg(env, args);
+      args = cdr(args);
+    }
+    if (have == argc && args.type != PairType) {
+      return symbols_get_native(pair.left.data)(argc, argv);
+    }
+    set_quick(val, Q_NATIVE);
+    int more = list_length(args);
+    value_t all[have + more ? have + more : 1];
+    for (int i = 0; i < have; i++) all[i] = argv[i];
+    eval_args(env, args, all + have);
+    return symbols_get_native(pair.left.data)(have + more, all);
   }
-  // For everything else, pre-eval the arguments.
-  value_t copy = cons(eval(env, head), Nil);
-  value_t cnode = copy;
-  while (val.type == PairType) {
-    value_t nextNode = cons(eval(env, next(&val)), Nil);
-    set_cdr(cnode, nextNode);
-    cnode = nextNode;
+  if (quick == Q_NATIVE) {
+    int argc = list_length(pair.right);
+    value_t argv[argc ? argc : 1];
+    eval_args(env, pair.right, argv);
+    return symbols_get_native(pair.left.data)(argc, argv);
   }
+  // For everything else, pre-eval the arguments onto the C stack.
+  value_t fn = eval(env, next(&val));
+  int argc = list_length(val);
+  value_t argv[argc ? argc : 1];
+  eval_args(env, val, argv);
   #ifdef TRACE
     print_string(space, indent - 1);
     print("mid: ");
-    full_dump(copy);
+    full_dump(cons(fn, list_of(argc, argv)));
   #endif
-  // And apply as normal
-  head = next(&copy);
-  return apply(head, copy);
+  // And call as normal
+  return call(fn, argc, argv);
 }
 
 API value_t eval(value_t env, value_t val) {
@@ -96,22 +208,179 @@ API value_t block(value_t env, value_t body) {
   return result;
 }
 
-// args is fn followed by arguments to apply to fn
-API value_t apply(value_t fn, value_t args) {
+// Strip if and do off an expression in tail position, evaluating their
+// conditions and leading expressions, until what's left is the value.
+static value_t tail_expr(value_t env, value_t expr) {
+  while (expr.type == PairType) {
+    value_t head = car(expr);
+    value_t args = cdr(expr);
+    if (eq(head, ifSym)) {
+      value_t cond = eval(env, next(&args));
+      if (!isTruthy(cond)) next(&args);
+      expr = next(&args);
+    }
+    else if (eq(head, doSym)) {
+      if (args.type != PairType) return Undefined;
+      expr = next(&args);
+      while (args.type == PairType) {
+        eval(env, expr);
+        expr = next(&args);
+      }
+    }
+    else {
+      break;
+    }
+  }
+  return expr;
+}
+
+// A closure is `(ClosureTag captures params body...)` where captures is
+// a table of the free variables of the body and their values when the
+// lambda was evaluated, EmptySlot for ones that weren't bound.  Only
+// lambda makes the tag, so quoted data never passes for a closure.
+API bool is_closure(value_t fn) {
+  return fn.type == PairType && eq(get_pair(fn).left, ClosureTag);
+}
+
+// The `(params body...)` list of a function or closure.
+API value_t fn_list(value_t fn) {
+  return is_closure(fn) ? cdr(get_pair(fn).right) : fn;
+}
+
+static value_t add_names(value_t form, value_t params, value_t names) {
+  if (form.type == SymbolType && form.data < 0) {
+    return list_has(params, form) ? names : list_add(names, form);
+  }
+  if (form.type != PairType) return names;
+  value_t head = get_pair(form).left;
+  if (eq(head, quoteSym)) return names;
+  // Quoted keys of get and set are variables too.
+  bool keys = eq(head, getSym) || eq(head, setSym);
+  while (form.type == PairType) {
+    value_t item = next(&form);
+    if (keys && item.type == PairType && eq(car(item), quoteSym)) {
+      item = cdr(item);
+    }
+    names = add_names(item, params, names);
+  }
+  return names;
+}
+
+// Variables a function list refers to other than its params, in order of
+// first use.
+API value_t free_names(value_t fn) {
+  value_t params = car(fn);
+  value_t names = Nil;
+  value_t body = cdr(fn);
+  while (body.type == PairType) {
+    names = add_names(next(&body), params, names);
+  }
+  return names;
+}
+
+// Add the bound captures of a closure to a new environment.
+static value_t bind_captures(value_t fn, value_t env) {
+  if (!is_closure(fn)) return env;
+  value_t captures = car(cdr(fn));
+  // Captures are free names, never params, so each is a new mapping.
+  while (captures.type == PairType) {
+    pair_t mapping = get_pair(next(&captures));
+    if (!eq(mapping.right, EmptySlot)) {
+      env = cons(cons(mapping.left, mapping.right), env);
+    }
+  }
+  return env;
+}
+
+// set adds to the table it's given and can't grow an empty one, so a
+// function with nothing bound yet gets a placeholder mapping to add after.
+static value_t env_open(value_t env) {
+  return isNil(env) ? cons(cons(EmptySlot, Undefined), Nil) : env;
+}
+
+// Bind the params of a tree-walked function in a new environment.
+static value_t bind(value_t fn, int argc, value_t *argv) {
+  value_t params = car(fn_list(fn));
+  value_t env = Nil;
+  for (int i = 0; params.type == PairType; i++) {
+    env = table_set(env, next(&params), i < argc ? argv[i] : Undefined);
+  }
+  return env_open(bind_captures(fn, env));
+}
+
+// Call fn with the argc arguments in argv.  A list is only built for
+// builtins that ask for one.
+API value_t call(value_t fn, int argc, value_t *argv) {
   // Native function.
   if (fn.type == SymbolType && fn.data >= 0) {
-    api_fn native = symbols_get_fn(fn.data);
-    return native(args);
+    native_fn native = symbols_get_native(fn.data);
+    if (native) return native(argc, argv);
+    return symbols_get_fn(fn.data)(list_of(argc, argv));
   }
-  // Create a new empty environment.
-  value_t subEnv = Nil;
-  // Apply arguments to parameters
-  value_t params = next(&fn);
-  while (params.type == PairType) {
-    subEnv = table_set(subEnv, next(&params), next(&args));
+  // Function compiled to bytecode.
+  code_t *code = vm_enabled ? code_find(fn) : 0;
+  if (code) return vm_call(fn, code, argc, argv);
+  return walk(fn, argc, argv);
+}
+
+// Run a function or closure with the tree-walker, compiled or not.  The vm
+// hands calls back here when its stacks are full.
+API value_t walk(value_t fn, int argc, value_t *argv) {
+  value_t env = bind(fn, argc, argv);
+  value_t body = cdr(fn_list(fn));
+  // Calls in tail position loop here instead of recursing so tail
+  // recursive functions run in constant C stack.
+  for (;;) {
+    // Run the body, all but the last expression as a normal block.
+    if (body.type != PairType) return Undefined;
+    value_t expr = next(&body);
+    while (body.type == PairType) {
+      eval(env, expr);
+      expr = next(&body);
+    }
+    expr = tail_expr(env, expr);
+    if (expr.type != PairType || is_keyword_call(expr)) {
+      return eval(env, expr);
+    }
+    fn = eval(env, next(&expr));
+    if ((fn.type == SymbolType && fn.data >= 0) ||
+        (vm_enabled && code_find(fn))) {
+      int num = list_length(expr);
+      value_t args[num ? num : 1];
+      eval_args(env, expr, args);
+      return call(fn, num, args);
+    }
+    // Another tree-walked function, evaluate its arguments straight into
+    // its new environment.
+    value_t params = car(fn_list(fn));
+    value_t subEnv = Nil;
+    while (expr.type == PairType) {
+      value_t arg = eval_arg(env, expr);
+      expr = cdr(expr);
+      if (params.type == PairType) {
+        subEnv = table_set(subEnv, next(&params), arg);
+      }
+    }
+    while (params.type == PairType) {
+      subEnv = table_set(subEnv, next(&params), Undefined);
+    }
+    env = env_open(bind_captures(fn, subEnv));
+    body = cdr(fn_list(fn));
   }
-  return block(subEnv, fn);
 }
 
+// args is a list of arguments to apply to fn
+API value_t apply(value_t fn, value_t args) {
+  // Builtins that take a list get it as is.
+  if (fn.type == SymbolType && fn.data >= 0 && symbols_get_fn(fn.data)) {
+    return symbols_get_fn(fn.data)(args);
+  }
+  int argc = list_length(args);
+  value_t argv[argc ? argc : 1];
+  for (int i = 0; i < argc; i++) {
+    argv[i] = next(&args);
+  }
+  return call(fn, argc, argv);
+}
 
 #endif
@@ -31,6 +31,10 @@ API api_fn symbols_get_fn(int index) {
   return index >= 0 ? builtins[index].fn : 0;
 }
 
+API native_fn symbols_get_native(int index) {
+  return index >= 0 ? builtins[index].native : 0;
+}
+
 // Resolve a symbol index to a null-terminated string.
 API const char *symbols_get_name(int index) {
   if (index >= 0) {
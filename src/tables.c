@@ -5,6 +5,13 @@
 
 // A table is a list of key/value pairs (possibly with nested tables in values).
 
+// Compiled callers may have inlined the function a global held, see
+// compiler.c.  Every write that replaces or removes one recompiles them,
+// whichever builtin it came through.
+static void global_changed(value_t table, value_t key, value_t old) {
+  if (eq(table, globals) && old.type == PairType) code_invalidate(key);
+}
+
 API bool is_table(value_t val) {
   while (val.type == PairType) {
     pair_t pair = get_pair(val);
@@ -24,6 +31,16 @@ API value_t table_get(value_t table, value_t key) {
   return Undefined;
 }
 
+// Like table_get, but returns the (key . value) cell itself or nil if missing.
+API value_t table_mapping(value_t table, value_t key) {
+  while (table.type == PairType) {
+    pair_t pair = get_pair(table);
+    if (eq(get_pair(pair.left).left, key)) return pair.left;
+    table = pair.right;
+  }
+  return Nil;
+}
+
 API value_t table_aget(value_t table, value_t keys) {
   if (isNil(keys)) return table;
   pair_t keypair = get_pair(keys);
@@ -46,6 +63,7 @@ API value_t table_set(value_t table, value_t key, value_t value) {
     pair_t mapping = get_pair(pair.left);
     if (eq(mapping.left, key)) {
       set_cdr(pair.left, value);
+      global_changed(table, key, mapping.right);
       return table;
     }
     if (isNil(pair.right)) {
@@ -70,6 +88,9 @@ API value_t table_aset(value_t map, value_t keys, value_t value) {
     pair_t mapping = get_pair(pair.left);
     if (eq(mapping.left, keypair.left)) {
       set_cdr(pair.left, table_aset(mapping.right, keypair.right, value));
+      if (isNil(keypair.right)) {
+        global_changed(map, keypair.left, mapping.right);
+      }
       return map;
     }
     if (isNil(pair.right)) {
@@ -107,7 +128,7 @@ API bool table_ahas(value_t map, value_t keys) {
 }
 
 API value_t table_del(value_t map, value_t key) {
-  value_t prev;
+  value_t prev = Nil;
   value_t node = map;
   while (node.type == PairType) {
     pair_t pair = get_pair(node);
@@ -115,6 +136,7 @@ API value_t table_del(value_t map, value_t key) {
     if (eq(mapping.left, key)) {
       if (eq(node, map)) return pair.right;
       set_cdr(prev, pair.right);
+      global_changed(map, key, mapping.right);
       return map;
     }
     prev = node;
@@ -126,7 +148,7 @@ API value_t table_del(value_t map, value_t key) {
 API value_t table_adel(value_t map, value_t keys) {
   if (isNil(keys)) return map;
   pair_t keypair = get_pair(keys);
-  value_t prev;
+  value_t prev = Nil;
   value_t node = map;
   while (node.type == PairType) {
     pair_t pair = get_pair(node);
@@ -135,6 +157,7 @@ API value_t table_adel(value_t map, value_t keys) {
       if (isNil(keypair.right)) {
         if (eq(node, map)) return pair.right;
         set_cdr(prev, pair.right);
+        global_changed(map, keypair.left, mapping.right);
         return map;
       }
       set_cdr(pair.left, table_adel(mapping.right, keypair.right));
@@ -21,8 +21,94 @@
 #define MAX_LINE_LENGTH 78
 #endif
 
+// Bytes of keyboard input handled per redraw.
+#ifndef EDITOR_READ_LENGTH
+#define EDITOR_READ_LENGTH 256
+#endif
+
+#ifndef READ_BUFFER_LENGTH
+#define READ_BUFFER_LENGTH 4096
+#endif
+
+// Bytes of a mapped script parsed per region.
+#ifndef MAP_SLICE_LENGTH
+#define MAP_SLICE_LENGTH 65536
+#endif
+
+// Keep parsed scripts in a cache file next to them, 0 to turn off.
+#ifndef SCRIPT_CACHE
+#define SCRIPT_CACHE 1
+#endif
+
 #ifndef WRITE_BUFFER_LENGTH
-#define WRITE_BUFFER_LENGTH 64
+#define WRITE_BUFFER_LENGTH 4096
+#endif
+
+#ifndef PRINT_MODE
+#define PRINT_MODE PRINT_AUTO
+#endif
+
+#ifndef PRINT_RING_SIZE
+#define PRINT_RING_SIZE 65536
+#endif
+
+#ifndef PRINT_OVERFLOW
+#define PRINT_OVERFLOW PRINT_BLOCK
+#endif
+
+// Default nesting depth and items per list dump prints, 0 for no limit.
+#ifndef DUMP_DEPTH
+#define DUMP_DEPTH 0
+#endif
+
+#ifndef DUMP_LENGTH
+#define DUMP_LENGTH 0
+#endif
+
+#ifndef GC_MIN_CELLS
+#define GC_MIN_CELLS 1024
+#endif
+
+#ifndef CODE_BUCKETS
+#define CODE_BUCKETS 64
+#endif
+
+#ifndef CODE_BLOCK_SIZE
+#define CODE_BLOCK_SIZE 64
+#endif
+
+#ifndef VM_STACK_SIZE
+#define VM_STACK_SIZE 4096
+#endif
+
+#ifndef INLINE_MAX
+#define INLINE_MAX 32
+#endif
+
+// Most arguments a quickened builtin call is specialized for, and deepest
+// into an environment a variable's place is remembered.
+#ifndef QUICK_ARGS
+#define QUICK_ARGS 4
+#endif
+
+#ifndef QUICK_SLOTS
+#define QUICK_SLOTS 32
+#endif
+
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 100
+#endif
+
+#ifndef VM_FRAMES
+#define VM_FRAMES 512
+#endif
+
+#ifndef PAR_THREADS
+#define PAR_THREADS 4
+#endif
+
+#ifndef PAR_MIN_ITEMS
+#define PAR_MIN_ITEMS 64
 #endif
 
 typedef enum {
@@ -50,28 +136,54 @@ typedef union {
 } pair_t;
 
 typedef value_t (*api_fn)(value_t args);
+typedef value_t (*native_fn)(int argc, value_t *argv);
 typedef void (*read_fn)(const char *data);
 
+// Builtins set one of fn or native.  Keywords and functions that want their
+// arguments as a list use fn, everything else gets them in a C array.
 typedef struct {
   const char* name;
   api_fn fn;
+  native_fn native;
 } builtin_t;
 
 API value_t quoteSym, listSym;
+API value_t getSym, setSym, doSym, ifSym, whileSym, lambdaSym;
+API value_t mapSym, filterSym, takeSym, streamSym;
 
 // Print library so we don't need a full-blown printf.
+typedef enum {
+  PRINT_AUTO, // line buffered on a terminal, else full
+  PRINT_LINE, // flush at every newline
+  PRINT_FULL, // flush when the buffer is full or on print_flush
+} print_mode_t;
+typedef enum {
+  PRINT_BLOCK, // wait for the writer thread to make room
+  PRINT_DROP,  // throw away output that doesn't fit
+  PRINT_COUNT, // same, then write how much was thrown away
+} print_overflow_t;
 API bool print(const char* value);
 API bool print_int(int num);
+API bool print_int_width(int num, int width);
+API bool print_hex(unsigned num, int width);
 API bool print_char(const char c);
 API bool print_string(const char* value, size_t len);
 API void print_flush();
 
+typedef struct {
+  long dropped;       // bytes thrown away because the output ring was full
+  long slowest_write; // longest a write took on the writer thread, in us
+} print_stats_t;
+API print_stats_t print_wait();
+API void print_to(int fd);
+
 // Symbol library for resolving between integers and cstrings.
 API int first_fn;
 API void symbols_init(const builtin_t *fns, int numKeywords);
 API int symbols_set(const char *word, size_t len);
 API const char *symbols_get_name(int index);
 API api_fn symbols_get_fn(int index);
+API native_fn symbols_get_native(int index);
 
 // Prints a value to stdout with newline
 API void dump(value_t val);
@@ -79,9 +191,20 @@ API void dump(value_t val);
 API void dump_line(value_t val);
 // Print a pair
 API void dump_pair(pair_t pair);
+// Like dump_line, eliding lists nested deeper or longer than the limits
+typedef struct {
+  int depth;
+  int length;
+} dump_limits_t;
+API void dump_limited(value_t val, dump_limits_t limits);
 
 // Data
 #define EmptySlot ((value_t){.type = AtomType, .data = -10})
+// Heads a stream, see iter.c.  Nothing reads or decodes to it, so no
+// list of the user's can pass for one.
+#define StreamTag ((value_t){.type = AtomType, .data = -6})
+// Heads a closure, see runtime.c, for the same reason.
+#define ClosureTag ((value_t){.type = AtomType, .data = -7})
 #define RangeError ((value_t){.type = AtomType, .data = -5})
 #define TypeError ((value_t){.type = AtomType, .data = -4})
 #define Dot ((value_t){.type = AtomType, .data = -3})
@@ -101,7 +224,19 @@ API void dump_pair(pair_t pair);
 API value_t copy(value_t value);
 API value_t free_list(value_t node);
 API pair_t free_cell(value_t node);
+API bool gc_log;
 API int collectgarbage(value_t root);
+API void region_begin();
+API int region_end(value_t root);
+API void gc_keep(value_t *root);
+API void gc_stack(const void *base);
+API void gc_pause(bool pause);
+API void vm_roots(void (*mark)(value_t));
+API bool is_live(value_t slot);
+API bool visit(value_t slot);
+API void visits_clear();
+API uint32_t code_edits;
+API void code_cells(value_t node);
 API pair_t get_pair(value_t slot);
 API value_t next(value_t *args);
 API value_t Bool(bool val);
@@ -109,24 +244,128 @@ API value_t Integer(int32_t val);
 API value_t Symbol(const char* sym);
 API value_t SymbolRange(const char* start, const char* end);
 
+// What __eval found a form to be the first time it ran, or what an
+// argument list cell held, kept per cell and reset to Q_NONE whenever the
+// cell is written.  Kinds that guard on something the write can't reset
+// fall back to a generic one when the guard fails.
+typedef enum {
+  Q_NONE,    // not evaluated since it was written
+  Q_GENERIC, // evaluate the head and call it
+  Q_KEYWORD, // head is a keyword
+  Q_NATIVE,  // head is a builtin taking an array, arguments counted
+  Q_NATIVE_N, // up to + QUICK_ARGS: that builtin with this many arguments
+  Q_ARG = Q_NATIVE_N + QUICK_ARGS + 1, // argument to evaluate
+  Q_CONST,   // argument that evaluates to itself
+  Q_SLOT,    // up to + QUICK_SLOTS: variable this many cells into the env
+} quick_t;
+
 API value_t cons(value_t left, value_t right);
 API value_t car(value_t var);
 API value_t cdr(value_t var);
 API bool set_car(value_t var, value_t val);
 API bool set_cdr(value_t var, value_t val);
+API uint8_t get_quick(value_t slot);
+API void set_quick(value_t slot, uint8_t kind);
 API pair_t get_pair(value_t slot);
 API bool eq(value_t a, value_t b);
 API bool isNil(value_t value);
 API bool isTruthy(value_t value);
 API bool isFree(pair_t pair);
 
+API value_t globals;
+API value_t lookup(value_t env, value_t key);
 API value_t eval(value_t env, value_t val);
 API value_t block(value_t env, value_t body);
 API value_t apply(value_t fn, value_t args);
+API value_t call(value_t fn, int argc, value_t *argv);
+API value_t walk(value_t fn, int argc, value_t *argv);
+API bool is_closure(value_t fn);
+API value_t fn_list(value_t fn);
+API value_t free_names(value_t fn);
+
+// Optimizer
+API value_t optimize(value_t form);
+API void optimize_fn(value_t fn);
+API bool is_pure(value_t fn);
+
+// Parallel map
+#ifdef THREADS
+API int par_threads;
+#endif
+API value_t par_map(value_t fn, value_t list, bool keep);
+
+// Bytecode
+typedef enum {
+  LIT, // (-- value) push constant, u16 index into consts
+  GET, // (-- value) push local slot, u8 index, unset slots read globals
+  SET, // (value -- value) store into local slot, u8 index
+  GBL, // (-- value) look up constant symbol in globals, u16 index
+  DRP, // (a --)
+  JMP, // (--) relative jump, i16 offset
+  IF,  // (cond --) relative jump when cond is falsy, i16 offset
+  CAL, // (fn args... -- value) call with u8 argument count
+  TCL, // (fn args... -- value) call in tail position, reusing the frame
+  RET, // (value --) return from function
+  CLO, // (-- closure) u16 const fn list, u8 count, count * (u16 name, u8 slot)
+  ADD, // (a b -- a+b) inlined builtins, same results as the natives
+  SUB, // (a b -- a-b)
+  LT,  // (a b -- a<b)
+  EQ,  // (a b -- a=b)
+  CAR, // (pair -- car)
+  CDR, // (pair -- cdr)
+} opcode_t;
+
+// Where jitted code stopped, the interpreter carries on from there.
+typedef struct {
+  const uint8_t *ip;
+  value_t *sp;
+} jit_exit_t;
+
+// Jitted code starts at the template at, one of code->jit_starts.
+typedef jit_exit_t (*jit_fn)(value_t *base, value_t *sp, const void *at);
+
+typedef struct code_s {
+  struct code_s *next; // next code in the same bucket
+  value_t fn;          // function list this was compiled from
+  pair_t head;         // first cell of fn when compiled
+  uint64_t hash;       // of fn and inlined functions, to detect edits
+  uint32_t edits;      // code_edits when hash was last checked
+  uint8_t *ops;
+  int len;             // 0 if fn couldn't be compiled
+  value_t *consts;
+  int num_consts;
+  value_t *names;      // name of every local slot, params then captures
+  int num_params;
+  int num_captures;
+  int num_locals;
+  int max_stack;       // deepest the operand stack gets above the locals
+  bool impure;         // calls more than pure builtins or builds closures
+  value_t *inlined;    // globals whose functions were inlined
+  int num_inlined;
+#ifdef JIT
+  int calls;           // frames entered and loops run, up to JIT_THRESHOLD
+  jit_fn jit;          // machine code for the whole function
+  size_t jit_size;
+  int *jit_starts;     // offset into jit of the template for each op
+#endif
+} code_t;
+
+API bool vm_enabled;
+API code_t *code_compile(value_t fn, value_t captures);
+API code_t *code_find(value_t fn);
+API void code_invalidate(value_t name);
+API void code_sweep();
+API value_t vm_call(value_t fn, code_t *code, int argc, value_t *argv);
+#ifdef JIT
+API bool jit_enabled;
+API bool jit_compile(code_t *code);
+API void jit_free(code_t *code);
+#endif
 
 // Lists
 API bool is_list(value_t val);
 API int list_length(value_t list);
+API value_t list_of(int len, const value_t *values);
 API value_t list_reverse(value_t list);
 API value_t list_ireverse(value_t list);
 API value_t list_append(value_t list, value_t values);
@@ -148,15 +387,54 @@ API bool is_table(value_t val);
 API bool table_has(value_t map, value_t key);
 API bool table_ahas(value_t map, value_t keys);
 API value_t table_get(value_t table, value_t key);
+API value_t table_mapping(value_t table, value_t key);
 API value_t table_aget(value_t table, value_t keys);
 API value_t table_set(value_t table, value_t key, value_t value);
 API value_t table_aset(value_t map, value_t keys, value_t value);
 API value_t table_del(value_t map, value_t key);
 API value_t table_adel(value_t map, value_t keys);
 
-// Iterators
-typedef void (*callback_t)(value_t ctx, value_t item);
+// Reader
+typedef enum {
+  READ_NONE,
+  READ_MINUS,  // a sign or the start of a symbol
+  READ_NUMBER,
+  READ_SYMBOL,
+  READ_STRING,
+} read_state_t;
+typedef struct {
+  value_t stack;      // values of the lists around the open one
+  value_t value;      // items of the open list so far, last first
+  value_t forms;      // top level forms done, last first
+  read_state_t state;
+  bool quote;
+  bool neg;
+  int num;
+  char *token;        // symbol or string so far
+  size_t len;
+  size_t cap;
+} parser_t;
+#define Parser() ((parser_t){ .stack = Nil, .value = Nil, .forms = Nil })
+API void parser_feed(parser_t *parser, const char *data, size_t len);
+API value_t parser_take(parser_t *parser);
+API value_t parser_end(parser_t *parser, const char **problem);
+
+// Binary encoding
+typedef struct {
+  uint8_t *data;
+  size_t len;
+  size_t cap;
+} bytes_t;
+API void bytes_put(bytes_t *out, uint8_t byte);
+API bool encode(value_t val, bytes_t *out);
+API long decode(const uint8_t *data, size_t len, value_t *out);
+
+// Iterators, a callback returns false to stop early.
+typedef bool (*callback_t)(value_t ctx, int index, value_t item);
 API void iter_any(value_t iter, value_t ctx, callback_t fn);
+API bool is_stream(value_t val);
+API value_t stream_of(value_t iter);
+API value_t stream_add(value_t stream, value_t kind, value_t fn);
 
 
 #endif
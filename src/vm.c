@@ -0,0 +1,283 @@
+#ifndef VM_C
+#define VM_C
+
+#include "types.h"
+
+// Stack machine for functions compiled by compiler.c.  Calls between
+// compiled functions push a frame instead of recursing in C, everything
+// else goes back through apply.  Once the frames or the stack run out,
+// further calls are tree-walked instead, recursing in C from there on.
+
+typedef struct {
+  code_t *code;
+  const uint8_t *ip;
+  value_t *base; // first local, the callee itself sits just below
+} frame_t;
+
+API bool vm_enabled = true;
+
+// Every thread gets its own stack for pmap, see parallel.c.
+#ifdef THREADS
+#define VM_LOCAL _Thread_local
+#else
+#define VM_LOCAL
+#endif
+
+static VM_LOCAL value_t vm_stack[VM_STACK_SIZE];
+static VM_LOCAL frame_t vm_frames[VM_FRAMES];
+static VM_LOCAL value_t *vm_sp; // set on the first call, see vm_call
+static VM_LOCAL frame_t *vm_fp;
+
+static int read16(const uint8_t *ip) {
+  return (int16_t)(ip[0] | ip[1] << 8);
+}
+
+// Is there room for a frame above fp for code with its locals at base?
+static bool vm_fits(code_t *code, frame_t *fp, value_t *base) {
+  return fp + 1 < vm_frames + VM_FRAMES &&
+    base + code->num_locals + code->max_stack <= vm_stack + VM_STACK_SIZE;
+}
+
+// Push a frame for code with argc arguments on top of the stack.  Missing
+// params read as undefined, unset locals are marked as empty slots.
+static void vm_push_frame(code_t *code, int argc) {
+  value_t *base = vm_sp - argc;
+  for (int i = argc; i < code->num_params; i++) base[i] = Undefined;
+  for (int i = code->num_params; i < code->num_locals; i++) base[i] = EmptySlot;
+  // Captured values of a closure, base[-1] being the closure itself.
+  if (code->num_captures && is_closure(base[-1])) {
+    value_t captures = car(cdr(base[-1]));
+    value_t *slot = base + code->num_params;
+    while (captures.type == PairType) *slot++ = cdr(next(&captures));
+  }
+  vm_sp = base + code->num_locals;
+  *++vm_fp = (frame_t){
+    .code = code,
+    .ip = code->ops,
+    .base = base,
+  };
+}
+
+// With GCC or clang every opcode handler jumps straight to the next one
+// through a label table, so each gets its own indirect branch to predict.
+// Build with -DVM_SWITCH (or any other compiler) for a plain switch loop.
+#if defined(__GNUC__) && !defined(VM_SWITCH)
+#define NEXT __extension__ ({ goto *labels[*ip++]; })
+#define DISPATCH() NEXT;
+#define CASE(op) do_##op
+#else
+#define DISPATCH() switch ((opcode_t)*ip++)
+#define CASE(op) case op
+#define NEXT break
+#endif
+
+// Hot functions are jitted, counting both frames entered and loops run, so
+// a long loop is jitted in the middle of its frame.  The machine code runs
+// from there and leaves ip and sp at the first op it can't do.  Once the
+// interpreter has done that op (a call, a closure, or a type the templates
+// don't handle) it goes back into the machine code, after calls and
+// closures and at loop back-edges.
+#ifdef JIT
+#define JIT_RUN() { \
+    const uint8_t *at = (const uint8_t *)(uintptr_t)code->jit + \
+      code->jit_starts[ip - code->ops]; \
+    jit_exit_t exit = code->jit(base, sp, at); \
+    ip = exit.ip; \
+    sp = exit.sp; \
+  }
+#define JIT_ENTER() \
+  if (jit_enabled && (code->jit || (code->calls < JIT_THRESHOLD && \
+      ++code->calls == JIT_THRESHOLD && jit_compile(code)))) JIT_RUN()
+#define JIT_RESUME() if (jit_enabled && code->jit) JIT_RUN()
+#else
+#define JIT_ENTER()
+#define JIT_RESUME()
+#endif
+
+// Run until the frame above floor returns.
+static value_t vm_run(frame_t *floor) {
+#if defined(__GNUC__) && !defined(VM_SWITCH)
+  __extension__ static const void *labels[] = {
+    [LIT] = &&do_LIT, [GET] = &&do_GET, [SET] = &&do_SET, [GBL] = &&do_GBL,
+    [DRP] = &&do_DRP, [JMP] = &&do_JMP, [IF] = &&do_IF, [CAL] = &&do_CAL,
+    [TCL] = &&do_TCL, [RET] = &&do_RET, [ADD] = &&do_ADD, [SUB] = &&do_SUB,
+    [LT] = &&do_LT, [EQ] = &&do_EQ, [CAR] = &&do_CAR, [CDR] = &&do_CDR,
+    [CLO] = &&do_CLO,
+  };
+#endif
+  frame_t *fp = vm_fp;
+  code_t *code = fp->code;
+  const uint8_t *ip = fp->ip;
+  value_t *base = fp->base;
+  value_t *sp = vm_sp;
+  JIT_ENTER();
+  for (;;) {
+    DISPATCH() {
+      CASE(LIT):
+        *sp++ = code->consts[(uint16_t)read16(ip)];
+        ip += 2;
+        NEXT;
+      CASE(GET): {
+        value_t val = base[*ip];
+        if (eq(val, EmptySlot)) val = table_get(globals, code->names[*ip]);
+        *sp++ = val;
+        ip++;
+        NEXT;
+      }
+      CASE(SET):
+        base[*ip++] = sp[-1];
+        NEXT;
+      CASE(GBL):
+        *sp++ = table_get(globals, code->consts[(uint16_t)read16(ip)]);
+        ip += 2;
+        NEXT;
+      CASE(DRP):
+        sp--;
+        NEXT;
+      CASE(JMP): {
+        int offset = read16(ip);
+        ip += offset + 2;
+        if (offset < 0) {
+          JIT_ENTER();
+        }
+        NEXT;
+      }
+      CASE(IF):
+        ip += isTruthy(*--sp) ? 2 : read16(ip) + 2;
+        NEXT;
+      CASE(ADD): {
+        value_t b = *--sp;
+        value_t a = sp[-1];
+        sp[-1] = a.type == IntegerType && b.type == IntegerType ?
+          Integer(a.data + b.data) : TypeError;
+        NEXT;
+      }
+      CASE(SUB): {
+        value_t b = *--sp;
+        value_t a = sp[-1];
+        sp[-1] = a.type == IntegerType && b.type == IntegerType ?
+          Integer(a.data - b.data) : TypeError;
+        NEXT;
+      }
+      CASE(LT): {
+        value_t b = *--sp;
+        value_t a = sp[-1];
+        sp[-1] = a.type == IntegerType && b.type == IntegerType ?
+          Bool(a.data < b.data) : TypeError;
+        NEXT;
+      }
+      CASE(EQ): {
+        value_t b = *--sp;
+        sp[-1] = Bool(eq(sp[-1], b));
+        NEXT;
+      }
+      CASE(CAR):
+        sp[-1] = car(sp[-1]);
+        NEXT;
+      CASE(CDR):
+        sp[-1] = cdr(sp[-1]);
+        NEXT;
+      CASE(CLO): {
+        value_t fn = code->consts[(uint16_t)read16(ip)];
+        int count = ip[2];
+        ip += 3;
+        vm_sp = sp; // for collections from cons
+        value_t captures[count ? count : 1];
+        for (int i = 0; i < count; i++, ip += 3) {
+          value_t name = code->consts[(uint16_t)read16(ip)];
+          captures[i] = cons(name, ip[2] == UINT8_MAX ? EmptySlot : base[ip[2]]);
+        }
+        *sp++ = cons(ClosureTag, cons(list_of(count, captures), fn));
+        JIT_RESUME();
+        NEXT;
+      }
+      CASE(CAL): CASE(TCL): {
+        bool tail = ip[-1] == TCL;
+        int argc = *ip++;
+        value_t fn = sp[-argc - 1];
+        vm_sp = sp; // code_find may compile again, see code_entry
+        code_t *callee = code_find(fn);
+        fp->ip = ip;
+        // A tail call reuses the frame, so only needs the stack.
+        if (callee && (tail ?
+            vm_fits(callee, fp - 1, base) : vm_fits(callee, fp, sp - argc))) {
+          // A tail call moves the callee and its arguments down over the
+          // current frame before pushing the new one in its place.
+          if (tail) {
+            value_t *dest = base - 1;
+            for (int i = -argc - 1; i < 0; i++) *dest++ = sp[i];
+            sp = dest;
+            vm_fp = --fp;
+          }
+          vm_sp = sp;
+          vm_push_frame(callee, argc);
+          fp = vm_fp;
+          code = callee;
+          ip = code->ops;
+          base = fp->base;
+          sp = vm_sp;
+          JIT_ENTER();
+          NEXT;
+        }
+        // Everything else reads its arguments straight off the stack.
+        vm_sp = sp;
+        value_t result = call(fn, argc, sp - argc);
+        sp -= argc + 1;
+        vm_sp = sp;
+        *sp++ = result;
+        if (tail) goto ret;
+        JIT_RESUME();
+        NEXT;
+      }
+      CASE(RET): ret: {
+        value_t result = sp[-1];
+        sp = base - 1;
+        vm_fp = --fp;
+        if (fp == floor) {
+          vm_sp = sp;
+          return result;
+        }
+        *sp++ = result;
+        code = fp->code;
+        ip = fp->ip;
+        base = fp->base;
+        JIT_RESUME();
+        NEXT;
+      }
+    }
+  }
+}
+
+#undef DISPATCH
+#undef CASE
+#undef NEXT
+#undef JIT_RUN
+#undef JIT_ENTER
+#undef JIT_RESUME
+
+// Pass every value on the stacks of running calls to mark.  Each run keeps
+// its top in a local, so ops that can allocate store it in vm_sp first.
+API void vm_roots(void (*mark)(value_t)) {
+  for (value_t *at = vm_stack; vm_sp && at < vm_sp; at++) mark(*at);
+}
+
+// Call fn, a function or closure compiled to code.
+API value_t vm_call(value_t fn, code_t *code, int argc, value_t *argv) {
+  if (!vm_sp) {
+    vm_sp = vm_stack;
+    vm_fp = vm_frames;
+  }
+  if (vm_sp + argc + 1 > vm_stack + VM_STACK_SIZE ||
+      !vm_fits(code, vm_fp, vm_sp + 1)) {
+    return walk(fn, argc, argv);
+  }
+  frame_t *floor = vm_fp;
+  *vm_sp++ = fn;
+  for (int i = 0; i < argc; i++) {
+    *vm_sp++ = argv[i];
+  }
+  vm_push_frame(code, argc);
+  return vm_run(floor);
+}
+
+#endif
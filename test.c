@@ -2,206 +2,327 @@
 
 #include "src/types.h"
 
-void test() {
+// Behaviour checks, run with make test.  Each check runs its source once in
+// the tree-walker and once in the vm, the last form must give what expected
+// reads as both times.
 
+static int test_failures;
+// Kept by collections, see test().
+static value_t test_want;
+static value_t test_got;
+
+// Same shape and atoms, for results that aren't the very same cells.
+// Errors don't read back, so expected values name them instead.
+static bool test_equal(value_t a, value_t b) {
+  while (a.type == PairType && b.type == PairType) {
+    if (!test_equal(car(a), car(b))) return false;
+    a = cdr(a);
+    b = cdr(b);
+  }
+  if (eq(b, Symbol("type-error"))) b = TypeError;
+  return eq(a, b);
+}
+
+// Run in a region like a script, so collections happen as they would.
+static value_t test_run(const char *source) {
+  region_begin();
+  value_t forms = read_forms(source);
+  value_t result = Undefined;
+  while (forms.type == PairType) result = eval(repl, optimize(next(&forms)));
+  test_got = result;
+  region_end(repl);
+  return result;
+}
+
+static void test_fail(const char *name, value_t got, value_t want) {
+  test_failures++;
+  print(name);
+  print(": got ");
+  dump(got);
+  print(name);
+  print(": expected ");
+  dump(want);
+}
+
+static void test_check(const char *name, const char *source,
+    const char *expected) {
+  test_want = car(read_forms(expected));
+  for (int vm = 0; vm < 2; vm++) {
+    vm_enabled = vm;
+    value_t got = test_run(source);
+    if (!test_equal(got, test_want)) test_fail(name, got, test_want);
+  }
+  vm_enabled = true;
+}
+
+static void test_compiler() {
+  test_check("fib",
+    "(def fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))"
+    "(fib 15)",
+    "610");
+  test_check("while",
+    "(def sum-to (n) (set 'i 0 's 0)"
+    " (while (< i n) (set 's (+ s i) 'i (+ i 1))) s)"
+    "(sum-to 100)",
+    "4950");
+  test_check("tail call",
+    "(def countdown (n) (if (= n 0) 'done (countdown (- n 1))))"
+    "(countdown 100000)",
+    "done");
+  test_check("deeper than the vm",
+    "(def sumto (n) (if (= n 0) 0 (+ n (sumto (- n 1)))))"
+    "(sumto 2000)",
+    "2001000");
+  test_check("globals",
+    "(set 'base 40)"
+    "(def plus-base (n) (+ n base))"
+    "(plus-base 2)",
+    "42");
+  test_check("locals without params",
+    "(def locals () (set 'x (car '(5))) (+ x 1))"
+    "(locals)",
+    "6");
+  test_check("body edited deep inside",
+    "(def inc (n) (+ n 1))"
+    "(inc 1)"
+    "(set-car (cdr (car (cdr inc))) 10)"
+    "(inc 1)",
+    "11");
+  // The edited list is compiled again.
+  assert(code_find(table_get(repl, Symbol("inc"))));
+  test_check("builtin names",
+    "(def car (x) x)",
+    "type-error");
+}
+
+static void test_quickening() {
+  test_check("builtin given another argument",
+    "(def add-one (a) (+ a 1))"
+    "(add-one 1)"
+    "(set-cdr (cdr (cdr (car (cdr add-one)))) '(10))"
+    "(add-one 1)",
+    "12");
+  test_check("builtin given one less",
+    "(def add-two (a) (+ a 1 1))"
+    "(add-two 1)"
+    "(set-cdr (cdr (car (cdr add-two))) nil)"
+    "(add-two 1)",
+    "1");
+  test_check("variables moved in the env",
+    "(set 'form '(- a b))"
+    "(list (eval form '((a . 1) (b . 2))) (eval form '((b . 20) (a . 10))))",
+    "(-1 -10)");
+  test_check("constants edited",
+    "(def seven () (+ 3 (car '(4))))"
+    "(seven)"
+    "(set-car (cdr (car (cdr seven))) 30)"
+    "(seven)",
+    "34");
+}
+
+static void test_inliner() {
+  test_check("inlined",
+    "(def odd (n) (= 1 (% n 2)))"
+    "(def count-odd (n) (set 'c 0)"
+    " (while (< 0 n) (if (odd n) (set 'c (+ c 1))) (set 'n (- n 1))) c)"
+    "(count-odd 10)",
+    "5");
+  test_check("redefined callee",
+    "(def odd (n) (= 1 (% n 2)))"
+    "(def count-odd (n) (set 'c 0)"
+    " (while (< 0 n) (if (odd n) (set 'c (+ c 1))) (set 'n (- n 1))) c)"
+    "(count-odd 10)"
+    "(def odd (n) true)"
+    "(count-odd 10)",
+    "10");
+  test_check("inlined body edited",
+    "(def inc (n) (+ n 1))"
+    "(def twice-inc (n) (* 2 (inc n)))"
+    "(twice-inc 1)"
+    "(set-car (cdr (cdr (car (cdr inc)))) 5)"
+    "(twice-inc 1)",
+    "12");
+  // The callee's params are gone once its body is done.
+  test_check("inlined params",
+    "(set 'n 100)"
+    "(def odd (n) (= 1 (% n 2)))"
+    "(def g () (if (odd 3) n 0))"
+    "(def h () (do (odd 4) n))"
+    "(list (g) (h))",
+    "(100 100)");
+  test_check("callee set through the table",
+    "(def one () 1)"
+    "(def two () (+ (one) (one)))"
+    "(two)"
+    "(t-set! env 'one '(() 5))"
+    "(two)",
+    "10");
+}
+
+static void test_closures() {
+  test_check("captures",
+    "(def adder (k) (lambda (x) (+ x k)))"
+    "(set 'add2 (adder 2))"
+    "(add2 3)",
+    "5");
+  test_check("each closure its own",
+    "(def adder (k) (lambda (x) (+ x k)))"
+    "(set 'add2 (adder 2) 'add7 (adder 7))"
+    "(list (add2 1) (add7 1))",
+    "(3 8)");
+  test_check("closure called directly",
+    "(def adder (k) (lambda (x) (+ x k)))"
+    "((adder 5) 1)",
+    "6");
+  test_check("captures set for the call only",
+    "(def mk (k) (lambda (x) (set 'k (+ k x)) k))"
+    "(set 'acc (mk 10))"
+    "(list (acc 1) (acc 1))",
+    "(11 11)");
+  test_check("quoted lists aren't closures",
+    "(set 'data '(lambda ((k . 1)) (x) (+ x k)))"
+    "(data 2)",
+    "type-error");
+  test_check("closures don't encode",
+    "(def adder (k) (lambda (x) (+ x k)))"
+    "(encode (adder 3))",
+    "type-error");
+}
+
+static void test_encoding() {
+  test_check("round trip",
+    "(decode (encode '(1 (a . b) \"hi\" -5 ())))",
+    "(1 (a . b) \"hi\" -5 ())");
+  test_check("shared cells",
+    "(set 'x '(1 2))"
+    "(set 'y (decode (encode (list x x))))"
+    "(set-car (car y) 9)"
+    "(car (car (cdr y)))",
+    "9");
+  test_check("cycles",
+    "(set 'c '(1 2))"
+    "(set-cdr (cdr c) c)"
+    "(set 'd (decode (encode c)))"
+    "(list (car (cdr (cdr d))) (= (cdr (cdr d)) d))",
+    "(1 true)");
+  test_check("truncated",
+    "(decode (reverse (cdr (reverse (encode '(1 2 3))))))",
+    "type-error");
+  // Atoms the heap keeps for itself don't go either way.
+  test_check("streams refused",
+    "(encode (list 1 (stream 5)))",
+    "type-error");
+  test_check("unset captures refused",
+    "(encode (lambda (x) (+ x unset-global)))",
+    "type-error");
+  test_check("private atoms rejected",
+    "(list (decode '(1 0 1 19)) (decode '(1 0 1 11)) (decode '(1 0 1 5)))",
+    "(type-error type-error type-error)");
+  test_check("not bytes",
+    "(decode '(1 300))",
+    "type-error");
+}
+
+static void test_reader() {
+  const char *text = "(a (b \"c d\") 12) 'e (f";
+  value_t want = read_forms("(a (b \"c d\") 12) 'e");
+  // Any split of the input reads the same.
+  for (size_t piece = 1; piece < 6; piece++) {
+    parser_t parser = Parser();
+    size_t len = strlen(text);
+    value_t forms = Nil;
+    for (size_t at = 0; at < len; at += piece) {
+      parser_feed(&parser, text + at, len - at < piece ? len - at : piece);
+      forms = list_append(forms, parser_take(&parser));
+    }
+    const char *problem;
+    forms = list_append(forms, parser_end(&parser, &problem));
+    if (!test_equal(forms, want)) test_fail("reader pieces", forms, want);
+    assert(problem && !strcmp(problem, "unclosed list"));
+  }
+  parser_t parser = Parser();
+  parser_feed(&parser, "\"open", 5);
+  const char *problem;
+  parser_end(&parser, &problem);
+  assert(problem && !strcmp(problem, "unterminated string"));
+  test_check("read", "(read \"(a (b))\")", "((a (b)))");
+  test_check("read cut short", "(read \"(a (b\")", "type-error");
+}
+
+// Hot enough to be jitted when built with -DJIT, which changes nothing.
+static void test_jit() {
+  test_check("jitted globals, car, cdr and calls",
+    "(set 'bump 3)"
+    "(def walk (xs) (set 's 0)"
+    " (while xs (set 's (+ s (car xs) bump) 'xs (cdr xs))) (list s))"
+    "(def runs (k) (set 't 0)"
+    " (while (< 0 k) (set 't (+ t (car (walk '(1 2 3)))) 'k (- k 1))) t)"
+    "(runs 200)",
+    "3000");
+  test_check("jitted in the middle of a loop",
+    "(def tally (n) (set 'i 0 'c 0)"
+    " (while (< i n) (if (= (car (list (% i 2))) 1) (set 'c (+ c 1)))"
+    " (set 'i (+ i 1))) c)"
+    "(tally 1000)",
+    "500");
+#ifdef JIT
+  assert(code_find(table_get(repl, Symbol("walk")))->jit);
+  assert(code_find(table_get(repl, Symbol("tally")))->jit);
+#endif
+  test_check("jitted ops given other types",
+    "(def f (a b) (if (< a b) (- b a) (+ a b)))"
+    "(def g (k) (set 'r nil)"
+    " (while (< 0 k) (set 'r (list (f k 500) (f 'x 1)) 'k (- k 1))) r)"
+    "(g 300)",
+    "(499 type-error)");
+}
+
+static void test_gc() {
+  // Garbage made in a long loop is collected as it goes, not at the end.
+  test_check("long loop",
+    "(def churn (n) (set 'i 0 't nil)"
+    " (while (< i n) (set 't (list i i i i) 'i (+ i 1))) (list i t))"
+    "(churn 200000)",
+    "(200000 (199999 199999 199999 199999))");
+  assert(num_pairs < 200000);
+  test_check("kept across collections",
+    "(def build (n) (set 'acc nil)"
+    " (while (< 0 n) (set 'acc (cons n acc) 'n (- n 1))) acc)"
+    "(def churn (n) (set 'i 0) (while (< i n) (set 'i (+ i 1) 't (list i))) i)"
+    "(set 'kept (build 10000))"
+    "(churn 100000)"
+    "(list (length? kept) (sum kept))",
+    "(10000 50005000)");
+  test_check("closures across collections",
+    "(def adder (k) (lambda (x) (+ x k)))"
+    "(def mk (n) (set 'fs nil)"
+    " (while (< 0 n) (set 'fs (adder n) 'n (- n 1))) (fs 10))"
+    "(mk 100000)",
+    "11");
+}
+
+// Returns the number of failed checks.
+static int test() {
   assert(sizeof(pair_t) == 8);
   assert(sizeof(value_t) == 4);
   assert((Integer(1)).data == 1);
   assert((Integer(0)).data == 0);
   assert((Integer(-1)).data == -1);
+  gc_log = false;
+  gc_keep(&test_want);
+  gc_keep(&test_got);
 
-  value_t numbers = List(Integer(1), Integer(2), Integer(3), Integer(4));
-  value_t tim = List(
-    Mapping(name, Symbol("Tim")),
-    Mapping(age, Integer(34)),
-    Mapping(isProgrammer, Bool(true))
-  );
-  value_t jack = List(
-    Mapping(name, Symbol("Jack")),
-    Mapping(age, Integer(10)),
-    Mapping(isProgrammer, True)
-  );
-  print("tim.name: ");
-  dump(mget(tim, Symbol("name")));
-  print("tim.age: ");
-  dump(mget(tim, Symbol("age")));
-  print("tim.isProgrammer: ");
-  dump(mget(tim, Symbol("isProgrammer")));
-  print("tim.wat: ");
-  dump(mget(tim, Symbol("wat")));
-  print("has name: ");
-  dump(mhas(tim, Symbol("name")));
-  print("has wat: ");
-  dump(mhas(tim, Symbol("wat")));
-  print("set name: ");
-  dump(tim = mset(tim, Symbol("name"), Symbol("Timbo")));
-  print("set 42: ");
-  dump(tim = mset(tim, Integer(42), True));
-  print("set 42 on empty: ");
-  dump(mset(Nil, Integer(42), True));
-  dump(tim);
-  dump(numbers);
-  dump(cdr(numbers));
-  dump(cdr(cdr(numbers)));
-  dump(cdr(cdr(cdr(numbers))));
-  dump(cdr(cdr(cdr(cdr(numbers)))));
-  dump(cdr(cdr(cdr(cdr(cdr(numbers))))));
-  dump(tim);
-  dump(car(tim));
-  dump(cdr(tim));
-  dump(cons(tim, jack));
-  dump(cons(jack, tim));
-  print("Append tim and jack: ");
-  dump(append(tim, jack));
-  print("Just tim: ");
-  dump(tim);
-  print("Reverse tim: ");
-  dump(reverse(tim));
-  print("Reverse numbers: ");
-  dump(reverse(numbers));
-  dump(reverse(cdr(numbers)));
-  dump(reverse(cddr(numbers)));
-  value_t add = cons(
-    Symbol("+"),
-    cons(
-      Integer(1),
-      cons(
-        Integer(2),
-        Nil
-      )
-    )
-  );
-  dump(add);
-  dump(eval(Nil, add));
-  dump(List(
-    Symbol("def"),
-    Symbol("sequence"),
-    List(
-      Symbol("shuffle"),
-      List(
-        Symbol("concat"),
-        List(
-          Symbol("map"),
-          List(
-            Symbol("i"),
-            Symbol("size"),
-          ),
-          List(
-            Symbol("if"),
-            List(
-              Symbol("<"),
-              List(
-                Symbol("%"),
-                Symbol("i"),
-                Symbol("width")
-              ),
-              Symbol("ww")
-            ),
-            List(
-              Symbol("list"),
-              True,
-              Symbol("i")
-            )
-          )
-        ),
-        List(
-          Symbol("map"),
-          List(
-            Symbol("i"),
-            Symbol("size"),
-          ),
-          List(
-            Symbol("if"),
-            List(
-              Symbol("<"),
-              List(
-                Symbol("÷"),
-                Symbol("i"),
-                Symbol("width")
-              ),
-              Symbol("hh")
-            ),
-            List(
-              Symbol("list"),
-              False,
-              Symbol("i")
-            )
-          )
-        )
-      )
-    )
-  ));
-
-  dump(List(
-    Symbol("def"),
-    Symbol("add"),
-    List(
-      Symbol("a"),
-      Symbol("b")
-    ),
-    List(
-      Symbol("+"),
-      Symbol("a"),
-      Symbol("b")
-    )
-  ));
-
-  value_t env = List(
-    Mapping(name, Symbol("Tim")),
-    Mapping(age, Integer(34)),
-    Mapping(isProgrammer, True)
-  );
-  env = cons(cons(Symbol("tim"),env),env);
-  // mset(env, Symbol("tim"), env);
-  mset(env, Symbol("add"), Symbol("+"));
-
-  print("env: ");
-  dump(env);
-
-  const value_t *expressions = (const value_t[]){
-    List(Symbol("-"),Integer(5),Integer(2)),
-    List(Symbol("+"),Integer(1),Integer(2),Integer(3)),
-    List(Symbol("add"),Integer(1),Integer(2),Integer(3)),
-    List(Symbol("+"),
-      List(Symbol("*"),Integer(2),Integer(3)),
-      List(Symbol("/"),Integer(10),Integer(3)),
-      Integer(1)
-    ),
-    List(Symbol("+"),Integer(1),Integer(2)),
-    List(Integer(1),Integer(2),Integer(3)),
-    Integer(42),
-    Symbol("+"),
-    Symbol("what"),
-    Symbol("name"),
-    List(Symbol("list"), Symbol("age"), Symbol("isProgrammer")),
-    List(Symbol("quote"), Symbol("age"), Symbol("isProgrammer")),
-    List(Symbol("age"), Symbol("isProgrammer")),
-    Symbol("tim"),
-    List(Symbol("tim")),
-    List(Symbol("def"),
-      Symbol("greet"),
-      List(Symbol("person")),
-      List(Symbol("print"),
-        cons(Symbol("quote"),Symbol("hello")),
-        List(Symbol("mget"),Symbol("person"),cons(Symbol("quote"),Symbol("name"))))
-    ),
-    List(Symbol("set"),
-      Symbol("tim"),
-      List(
-        Symbol("quote"),
-        Mapping(name,Symbol("Tim")),
-        Mapping(age,Integer(34)),
-        Mapping(is-programmer,True)
-      )
-    ),
-    List(Symbol("greet"),Symbol("tim")),
-    cons(Symbol("list"),Integer(42)),
-    Nil,
-  };
-
-  for (int i = 0; !isNil(expressions[i]); i++) {
-    print("> ");
-    dump(expressions[i]);
-    dump(eval(env, expressions[i]));
-  }
+  test_compiler();
+  test_quickening();
+  test_inliner();
+  test_closures();
+  test_encoding();
+  test_reader();
+  test_jit();
+  test_gc();
+
+  print(test_failures ? "tests failed: " : "tests passed");
+  if (test_failures) print_int(test_failures);
+  print_char('\n');
+  return test_failures;
 }